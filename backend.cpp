@@ -0,0 +1,701 @@
+#include "backend.hpp"
+#include "darknetapi.hpp"
+#include "fusedmodel.hpp"
+#include "quantized.hpp"
+#include "utility.hpp"
+
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <filesystem>
+#include <random>
+#include <map>
+#include <mutex>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define NET_INPUT_SSE2
+#endif
+
+using namespace cv;
+using namespace std;
+
+FrameBuffer::FrameBuffer(const void* data, int width, int height, size_t stride, PixelFormat format) :
+	format(format), width(width), height(height) {
+	const unsigned char* pixels = (const unsigned char*)data;
+	planes[0] = pixels;
+	strides[0] = stride;
+	planes[1] = planes[2] = nullptr;
+	strides[1] = strides[2] = 0;
+	if (format == PixelFormat::NV12) {
+		planes[1] = pixels + stride * height;
+		strides[1] = stride;
+	}
+	else if (format == PixelFormat::I420) {
+		planes[1] = pixels + stride * height;
+		strides[1] = stride / 2;
+		planes[2] = planes[1] + strides[1] * ((height + 1) / 2);
+		strides[2] = strides[1];
+	}
+}
+
+void NetInput::ColumnTable::set(int dstWidth, int srcWidth, int step) {
+	if (srcWidth == this->srcWidth && step == this->step)
+		return;
+
+	// same sampling positions as cv::resize with INTER_LINEAR
+	offsets0.resize(dstWidth);
+	offsets1.resize(dstWidth);
+	weights.resize(dstWidth);
+	float scale = (float)srcWidth / dstWidth;
+	for (int x = 0; x < dstWidth; x++) {
+		float fx = (x + 0.5f) * scale - 0.5f;
+		int x0 = (int)floor(fx);
+		float weight = fx - x0;
+		if (x0 < 0) {
+			x0 = 0;
+			weight = 0;
+		}
+		if (x0 >= srcWidth - 1) {
+			x0 = srcWidth - 1;
+			weight = 0;
+		}
+		offsets0[x] = x0 * step;
+		offsets1[x] = min(x0 + 1, srcWidth - 1) * step;
+		weights[x] = weight;
+	}
+	this->srcWidth = srcWidth;
+	this->step = step;
+}
+
+// source rows and weight of the lower one for output row y, same as ColumnTable
+static void getRowSample(int y, int dstHeight, int srcHeight, int& y0, int& y1, float& weight) {
+	float fy = (y + 0.5f) * srcHeight / dstHeight - 0.5f;
+	y0 = (int)floor(fy);
+	weight = fy - y0;
+	if (y0 < 0) {
+		y0 = 0;
+		weight = 0;
+	}
+	if (y0 >= srcHeight - 1) {
+		y0 = srcHeight - 1;
+		weight = 0;
+	}
+	y1 = min(y0 + 1, srcHeight - 1);
+}
+
+static inline float bilinear(const uchar* r0, const uchar* r1, int o0, int o1, float wx, float wy) {
+	float top = r0[o0] + (r0[o1] - r0[o0]) * wx;
+	float bottom = r1[o0] + (r1[o1] - r1[o0]) * wx;
+	return top + (bottom - top) * wy;
+}
+
+#ifdef NET_INPUT_SSE2
+// bilinear of 4 columns, samples are gathered and interpolation runs on 4 lanes
+static inline __m128 bilinear4(const uchar* r0, const uchar* r1, const int* o0, const int* o1, __m128 wx, __m128 wy) {
+	__m128 a0 = _mm_setr_ps(r0[o0[0]], r0[o0[1]], r0[o0[2]], r0[o0[3]]);
+	__m128 b0 = _mm_setr_ps(r0[o1[0]], r0[o1[1]], r0[o1[2]], r0[o1[3]]);
+	__m128 a1 = _mm_setr_ps(r1[o0[0]], r1[o0[1]], r1[o0[2]], r1[o0[3]]);
+	__m128 b1 = _mm_setr_ps(r1[o1[0]], r1[o1[1]], r1[o1[2]], r1[o1[3]]);
+	__m128 top = _mm_add_ps(a0, _mm_mul_ps(_mm_sub_ps(b0, a0), wx));
+	__m128 bottom = _mm_add_ps(a1, _mm_mul_ps(_mm_sub_ps(b1, a1), wx));
+	return _mm_add_ps(top, _mm_mul_ps(_mm_sub_ps(bottom, top), wy));
+}
+#endif
+
+void NetInput::setPacked(const uchar* pixels, size_t stride, int srcWidth, int srcHeight, int channels, const int srcChannels[3]) {
+	columns.set(width, srcWidth, channels);
+
+	size_t planeSize = (size_t)width * height;
+	parallel_for_(Range(0, height), [&](const Range& range) {
+		for (int y = range.start; y < range.end; y++) {
+			int y0, y1;
+			float wy;
+			getRowSample(y, height, srcHeight, y0, y1, wy);
+			const uchar* row0 = pixels + stride * y0;
+			const uchar* row1 = pixels + stride * y1;
+
+			for (int k = 0; k < 3; k++) {
+				const uchar* r0 = row0 + srcChannels[k];
+				const uchar* r1 = row1 + srcChannels[k];
+				float* dst = data.data() + k * planeSize + (size_t)y * width;
+				int x = 0;
+#ifdef NET_INPUT_SSE2
+				const __m128 vwy = _mm_set1_ps(wy);
+				const __m128 vnorm = _mm_set1_ps(1 / 255.f);
+				for (; x <= width - 4; x += 4) {
+					__m128 value = bilinear4(r0, r1, &columns.offsets0[x], &columns.offsets1[x], _mm_loadu_ps(&columns.weights[x]), vwy);
+					_mm_storeu_ps(dst + x, _mm_mul_ps(value, vnorm));
+				}
+#endif
+				for (; x < width; x++)
+					dst[x] = bilinear(r0, r1, columns.offsets0[x], columns.offsets1[x], columns.weights[x], wy) * (1 / 255.f);
+			}
+		}
+	});
+}
+
+void NetInput::setYuv(const FrameBuffer& frame) {
+	bool nv12 = frame.format == PixelFormat::NV12;
+	int chromaWidth = (frame.width + 1) / 2;
+	int chromaHeight = (frame.height + 1) / 2;
+	columns.set(width, frame.width, 1);
+	chromaColumns.set(width, chromaWidth, nv12 ? 2 : 1);
+
+	size_t planeSize = (size_t)width * height;
+	parallel_for_(Range(0, height), [&](const Range& range) {
+		for (int y = range.start; y < range.end; y++) {
+			int y0, y1, c0, c1;
+			float wy, wc;
+			getRowSample(y, height, frame.height, y0, y1, wy);
+			getRowSample(y, height, chromaHeight, c0, c1, wc);
+			const uchar* luma0 = frame.planes[0] + frame.strides[0] * y0;
+			const uchar* luma1 = frame.planes[0] + frame.strides[0] * y1;
+			const uchar* u0 = frame.planes[1] + frame.strides[1] * c0;
+			const uchar* u1 = frame.planes[1] + frame.strides[1] * c1;
+			const uchar* v0 = nv12 ? u0 + 1 : frame.planes[2] + frame.strides[2] * c0;
+			const uchar* v1 = nv12 ? u1 + 1 : frame.planes[2] + frame.strides[2] * c1;
+			float* dstR = data.data() + (size_t)y * width;
+			float* dstG = dstR + planeSize;
+			float* dstB = dstG + planeSize;
+
+			int x = 0;
+#ifdef NET_INPUT_SSE2
+			const __m128 vwy = _mm_set1_ps(wy);
+			const __m128 vwc = _mm_set1_ps(wc);
+			const __m128 v16 = _mm_set1_ps(16.f), v128 = _mm_set1_ps(128.f);
+			const __m128 vzero = _mm_setzero_ps(), vone = _mm_set1_ps(1.f);
+			const __m128 yScale = _mm_set1_ps(1.164f / 255), vToR = _mm_set1_ps(1.596f / 255), vToG = _mm_set1_ps(-0.813f / 255);
+			const __m128 uToG = _mm_set1_ps(-0.391f / 255), uToB = _mm_set1_ps(2.018f / 255);
+			for (; x <= width - 4; x += 4) {
+				__m128 vwx = _mm_loadu_ps(&columns.weights[x]);
+				__m128 vwcx = _mm_loadu_ps(&chromaColumns.weights[x]);
+				__m128 luma = bilinear4(luma0, luma1, &columns.offsets0[x], &columns.offsets1[x], vwx, vwy);
+				__m128 u = bilinear4(u0, u1, &chromaColumns.offsets0[x], &chromaColumns.offsets1[x], vwcx, vwc);
+				__m128 v = bilinear4(v0, v1, &chromaColumns.offsets0[x], &chromaColumns.offsets1[x], vwcx, vwc);
+				luma = _mm_mul_ps(_mm_sub_ps(luma, v16), yScale);
+				u = _mm_sub_ps(u, v128);
+				v = _mm_sub_ps(v, v128);
+				__m128 r = _mm_add_ps(luma, _mm_mul_ps(v, vToR));
+				__m128 g = _mm_add_ps(luma, _mm_add_ps(_mm_mul_ps(v, vToG), _mm_mul_ps(u, uToG)));
+				__m128 b = _mm_add_ps(luma, _mm_mul_ps(u, uToB));
+				_mm_storeu_ps(dstR + x, _mm_min_ps(_mm_max_ps(r, vzero), vone));
+				_mm_storeu_ps(dstG + x, _mm_min_ps(_mm_max_ps(g, vzero), vone));
+				_mm_storeu_ps(dstB + x, _mm_min_ps(_mm_max_ps(b, vzero), vone));
+			}
+#endif
+			for (; x < width; x++) {
+				float luma = (bilinear(luma0, luma1, columns.offsets0[x], columns.offsets1[x], columns.weights[x], wy) - 16) * (1.164f / 255);
+				float u = bilinear(u0, u1, chromaColumns.offsets0[x], chromaColumns.offsets1[x], chromaColumns.weights[x], wc) - 128;
+				float v = bilinear(v0, v1, chromaColumns.offsets0[x], chromaColumns.offsets1[x], chromaColumns.weights[x], wc) - 128;
+				dstR[x] = min(max(luma + v * (1.596f / 255), 0.f), 1.f);
+				dstG[x] = min(max(luma - v * (0.813f / 255) - u * (0.391f / 255), 0.f), 1.f);
+				dstB[x] = min(max(luma + u * (2.018f / 255), 0.f), 1.f);
+			}
+		}
+	});
+}
+
+bool NetInput::set(const Mat& img) {
+	if (img.data == NULL || img.depth() != CV_8U)
+		return false;
+	int cn = img.channels();
+	if (cn != 1 && cn != 3 && cn != 4)
+		return false;
+
+	// BGR(A) source channel of each RGB plane, gray is repeated to all planes
+	const int bgrChannels[3] = { 2, 1, 0 };
+	const int grayChannels[3] = { 0, 0, 0 };
+	setPacked(img.data, img.step, img.cols, img.rows, cn, cn == 1 ? grayChannels : bgrChannels);
+	return true;
+}
+
+bool NetInput::set(const FrameBuffer& frame) {
+	if (frame.planes[0] == nullptr || frame.width <= 0 || frame.height <= 0)
+		return false;
+
+	const int bgrChannels[3] = { 2, 1, 0 };
+	const int rgbChannels[3] = { 0, 1, 2 };
+	const int grayChannels[3] = { 0, 0, 0 };
+	switch (frame.format) {
+	case PixelFormat::BGR:
+		setPacked(frame.planes[0], frame.strides[0], frame.width, frame.height, 3, bgrChannels);
+		return true;
+	case PixelFormat::RGB:
+		setPacked(frame.planes[0], frame.strides[0], frame.width, frame.height, 3, rgbChannels);
+		return true;
+	case PixelFormat::GRAY:
+		setPacked(frame.planes[0], frame.strides[0], frame.width, frame.height, 1, grayChannels);
+		return true;
+	case PixelFormat::NV12:
+	case PixelFormat::I420:
+		if (frame.planes[1] == nullptr || (frame.format == PixelFormat::I420 && frame.planes[2] == nullptr))
+			return false;
+		setYuv(frame);
+		return true;
+	}
+	return false;
+}
+
+void InferenceBackend::detectBatch(const vector<Mat>& imgs, vector<vector<bbox_t>>& bboxesList, float thresh, bool useMean) {
+	bboxesList.clear();
+	bboxesList.resize(imgs.size());
+	for (size_t i = 0; i < imgs.size(); i++)
+		if (imgs[i].data != NULL)
+			bboxesList[i] = detect(imgs[i], thresh, useMean);
+}
+
+// copy of cfg whose [net] section has width and height replaced
+static int writeCfgWithInputSize(const string& srcFileName, const string& dstFileName, int width, int height) {
+	ifstream ifs(srcFileName);
+	if (!ifs.is_open()) {
+		cerr << "fail to load cfg file " << srcFileName << endl;
+		return -1;
+	}
+	ofstream ofs(dstFileName);
+	if (!ofs.is_open()) {
+		cerr << "fail to write cfg file " << dstFileName << endl;
+		return -1;
+	}
+
+	bool inNet = false;
+	for (string line; getline(ifs, line);) {
+		if (line.size() > 0 && line[0] == '[')
+			inNet = line.compare(0, 5, "[net]") == 0;
+		size_t equal = line.find('=');
+		if (inNet && equal != string::npos) {
+			string key;
+			stringstream(line.substr(0, equal)) >> key;
+			if (key.compare("width") == 0)
+				line = "width=" + to_string(width);
+			else if (key.compare("height") == 0)
+				line = "height=" + to_string(height);
+		}
+		ofs << line << "\n";
+	}
+	return 0;
+}
+
+// [net] width and height of cfg, 416x416 if they aren't set
+static Size readCfgInputSize(const string& cfgFileName) {
+	Size size(416, 416);
+	ifstream ifs(cfgFileName);
+	for (string line; getline(ifs, line);) {
+		if (line.size() > 0 && line[0] == '[' && line.compare(0, 5, "[net]") != 0)
+			break;
+		size_t equal = line.find('=');
+		if (equal == string::npos)
+			continue;
+		string key, value;
+		stringstream(line.substr(0, equal)) >> key;
+		stringstream(line.substr(equal + 1)) >> value;
+		if (key.compare("width") == 0)
+			size.width = stoi(value);
+		else if (key.compare("height") == 0)
+			size.height = stoi(value);
+	}
+	return size;
+}
+
+// dark.dll exports no function freeing a network, so networks of destroyed backends are kept here by model, input size,
+// batch and gpu, and reused by later backends of the same key
+static mutex idleNetworksMutex;
+static multimap<string, DarknetNetwork*> idleNetworks;
+
+static DarknetNetwork* takeIdleNetwork(const string& key) {
+	lock_guard<mutex> lock(idleNetworksMutex);
+	auto it = idleNetworks.find(key);
+	if (it == idleNetworks.end())
+		return nullptr;
+	DarknetNetwork* network = it->second;
+	idleNetworks.erase(it);
+	return network;
+}
+
+static void keepIdleNetwork(const string& key, DarknetNetwork* network) {
+	lock_guard<mutex> lock(idleNetworksMutex);
+	idleNetworks.emplace(key, network);
+}
+
+// point convolutional weights of dst at the ones of src. own buffers of dst are freed if freeOwn is set, which is
+// only right for a network just loaded since nothing else points at them yet. host buffers are only read by forward
+// passes on CPU, networks on GPU keep their own copies in GPU memory
+static int shareConvWeights(DarknetNetwork* dst, DarknetNetwork* src, bool freeOwn) {
+	if (dst->n != src->n) {
+		cerr << "fail to share weights, networks have different layers" << endl;
+		return -1;
+	}
+	for (int i = 0; i < dst->n; i++) {
+		DarknetLayer* d = get_network_layer(dst, i);
+		DarknetLayer* s = get_network_layer(src, i);
+		if (d->type != DARKNET_CONVOLUTIONAL)
+			continue;
+		if (d->nweights != s->nweights || d->n != s->n || d->batch_normalize != s->batch_normalize) {
+			cerr << "fail to share weights of layer " << i << endl;
+			return -1;
+		}
+		float** dstBuffers[] = { &d->biases, &d->weights, &d->scales, &d->rolling_mean, &d->rolling_variance };
+		float* srcBuffers[] = { s->biases, s->weights, s->scales, s->rolling_mean, s->rolling_variance };
+		// buffers of batch normalization are left alone once it is folded into weights
+		int numBuffers = d->batch_normalize ? 5 : 2;
+		for (int k = 0; k < numBuffers; k++) {
+			if (*dstBuffers[k] == srcBuffers[k])
+				continue;
+			if (freeOwn)
+				free(*dstBuffers[k]);
+			*dstBuffers[k] = srcBuffers[k];
+		}
+	}
+	return 0;
+}
+
+// mapping of fused weights file shared by every backend of this process, never unmapped since networks can't be freed
+static const MappedFile* mapFusedWeights(const string& fileName) {
+	static mutex mappedFilesMutex;
+	static map<string, unique_ptr<MappedFile>> mappedFiles;
+	lock_guard<mutex> lock(mappedFilesMutex);
+	unique_ptr<MappedFile>& mappedFile = mappedFiles[fileName];
+	if (!mappedFile)
+		mappedFile.reset(new MappedFile(fileName));
+	return *mappedFile ? mappedFile.get() : nullptr;
+}
+
+// point convolutional biases and weights of network at fused weights file, which holds them layer by layer after
+// the header. freeOwn is same as shareConvWeights. darknet only reads them in forward passes, so read only pages do
+static int mapConvWeights(DarknetNetwork* network, const MappedFile& file, bool freeOwn) {
+	if (file.getSize() < sizeof(int32_t) * 3) {
+		cerr << "wrong header of mapped weights file" << endl;
+		return -1;
+	}
+	int32_t version[3];
+	memcpy(version, file.getData(), sizeof(version));
+	size_t size = getWeightsHeaderSize(version);
+	for (int i = 0; i < network->n; i++) {
+		DarknetLayer* l = get_network_layer(network, i);
+		if (l->type != DARKNET_CONVOLUTIONAL)
+			continue;
+		if (l->batch_normalize) {
+			cerr << "fail to map weights, layer " << i << " isn't fused" << endl;
+			return -1;
+		}
+		size += ((size_t)l->n + l->nweights) * sizeof(float);
+	}
+	if (size != file.getSize()) {
+		cerr << "fail to map weights, size of weights file doesn't match cfg" << endl;
+		return -1;
+	}
+
+	float* values = (float*)(file.getData() + getWeightsHeaderSize(version));
+	for (int i = 0; i < network->n; i++) {
+		DarknetLayer* l = get_network_layer(network, i);
+		if (l->type != DARKNET_CONVOLUTIONAL)
+			continue;
+		if (l->biases != values && freeOwn)
+			free(l->biases);
+		l->biases = values;
+		values += l->n;
+		if (l->weights != values && freeOwn)
+			free(l->weights);
+		l->weights = values;
+		values += l->nweights;
+	}
+	return 0;
+}
+
+// boxes of index-th image of network's last forward pass, in coordinates of image of imageSize. same as
+// Detector::detect
+static vector<bbox_t> getBboxes(DarknetNetwork* network, int index, Size imageSize, float thresh, float nms) {
+	// get_network_boxes reads the first image of batch, so outputs of detection layers are moved to index-th image
+	vector<DarknetLayer*> outLayers;
+	for (int i = 0; i < network->n; i++) {
+		DarknetLayer* l = get_network_layer(network, i);
+		if (l->type == DARKNET_YOLO || l->type == DARKNET_REGION || l->type == DARKNET_DETECTION) {
+			l->output += (size_t)index * l->outputs;
+			outLayers.push_back(l);
+		}
+	}
+	int num = 0;
+	DarknetDetection* dets = get_network_boxes(network, imageSize.width, imageSize.height, thresh, 0.5f, nullptr, 1, &num, 0);
+	for (DarknetLayer* l : outLayers)
+		l->output -= (size_t)index * l->outputs;
+	if (nms > 0 && num > 0)
+		do_nms_sort(dets, num, dets[0].classes, nms);
+
+	vector<bbox_t> bboxes;
+	for (int i = 0; i < num; i++) {
+		const DarknetDetection& det = dets[i];
+		int cls = (int)(max_element(det.prob, det.prob + det.classes) - det.prob);
+		if (det.prob[cls] <= thresh)
+			continue;
+		const DarknetBox& b = det.bbox;
+		bbox_t bbox = {};
+		bbox.x = (unsigned int)max((double)0, (b.x - b.w / 2.) * imageSize.width);
+		bbox.y = (unsigned int)max((double)0, (b.y - b.h / 2.) * imageSize.height);
+		bbox.w = (unsigned int)(b.w * imageSize.width);
+		bbox.h = (unsigned int)(b.h * imageSize.height);
+		bbox.prob = det.prob[cls];
+		bbox.obj_id = cls;
+		bboxes.push_back(bbox);
+	}
+	free_detections(dets, num);
+	return bboxes;
+}
+
+DarknetBackend::DarknetBackend(const string& cfgFileName, const string& weightFileName, int gpuId, bool mapWeights) :
+	cfgFileName(cfgFileName), weightFileName(weightFileName), gpuId(gpuId) {
+	if (mapWeights)
+		mappedWeights = mapFusedWeights(weightFileName);
+	DarknetNetwork* network = loadNetwork(0, 0, 1);
+	if (network == nullptr && mappedWeights != nullptr) {
+		cerr << "weights file " << weightFileName << " is read instead of mapped" << endl;
+		mappedWeights = nullptr;
+		network = loadNetwork(0, 0, 1);
+	}
+	networks.push_back(network);
+	netInputs.emplace_back(new NetInput(network_width(network), network_height(network)));
+}
+
+DarknetBackend::~DarknetBackend() {
+	for (size_t i = 0; i < networks.size(); i++) {
+		if (i == 0)
+			keepIdleNetwork(getNetworkKey(0, 0, 1), networks[i]);
+		else
+			keepIdleNetwork(getNetworkKey(netInputs[i]->width, netInputs[i]->height, 1), networks[i]);
+	}
+	if (batchNetwork != nullptr)
+		keepIdleNetwork(getNetworkKey(0, 0, batchNetwork->batch), batchNetwork);
+}
+
+string DarknetBackend::getNetworkKey(int width, int height, int batch) const {
+	// networks of mapped weights may not have their own weights, so they aren't given to backends reading the file
+	return cfgFileName + "|" + weightFileName + (mappedWeights != nullptr ? "|mapped|" : "|") + to_string(width) + "x" +
+		to_string(height) + "|" + to_string(batch) + "|" + to_string(gpuId);
+}
+
+DarknetNetwork* DarknetBackend::loadNetwork(int width, int height, int batch) {
+	DarknetNetwork* network = takeIdleNetwork(getNetworkKey(width, height, batch));
+	bool loaded = network == nullptr;
+	if (loaded) {
+		string networkCfgFileName = cfgFileName;
+		if (width > 0) {
+			// random suffix keeps processes starting together from writing and removing the same file
+			random_device random;
+			stringstream suffix;
+			suffix << hex << random() << random();
+			networkCfgFileName = (filesystem::temp_directory_path() / (filesystem::path(cfgFileName).stem().string() + "_" +
+				to_string(width) + "x" + to_string(height) + "_" + suffix.str() + ".cfg")).string();
+			if (writeCfgWithInputSize(cfgFileName, networkCfgFileName, width, height) < 0)
+				return nullptr;
+		}
+
+		// network on CPU takes weights from the mapping without reading the file, network on GPU still reads it to
+		// upload weights to GPU memory
+		string networkWeightFileName = mappedWeights != nullptr && get_device_count() <= 0 ? "" : weightFileName;
+
+		// same as Detector
+		cuda_set_device(gpuId);
+		network = load_network_custom((char*)networkCfgFileName.c_str(), (char*)networkWeightFileName.c_str(), 0, batch);
+		if (width > 0)
+			filesystem::remove(networkCfgFileName);
+		if (network->gpu_index >= 0)
+			network->gpu_index = gpuId;
+		fuse_conv_batchnorm(*network);
+	}
+
+	if (mappedWeights != nullptr) {
+		// network which fails to be mapped may have no weights, it is left out of idle networks
+		if (mapConvWeights(network, *mappedWeights, loaded) < 0)
+			return nullptr;
+	}
+	// every network after the first one points at its weights
+	else if (!networks.empty() && shareConvWeights(network, networks[0], loaded) < 0) {
+		keepIdleNetwork(getNetworkKey(width, height, batch), network);
+		return nullptr;
+	}
+	return network;
+}
+
+int DarknetBackend::addInputSize(int width, int height) {
+	DarknetNetwork* network = loadNetwork(width, height, 1);
+	if (network == nullptr)
+		return -1;
+	networks.push_back(network);
+	netInputs.emplace_back(new NetInput(width, height));
+	return (int)networks.size() - 1;
+}
+
+vector<bbox_t> DarknetBackend::detect(const Mat& img, float thresh, bool /*useMean*/, int inputSize) {
+	if (img.data == NULL)
+		throw runtime_error("Image is empty");
+	NetInput& netInput = *netInputs[inputSize];
+	if (!netInput.set(img)) {
+		// other depths are converted to 8 bit first
+		Mat converted;
+		img.convertTo(converted, CV_8U);
+		if (!netInput.set(converted))
+			throw runtime_error("Image type isn't supported");
+	}
+	network_predict_ptr(networks[inputSize], netInput.getImage().data);
+	return getBboxes(networks[inputSize], 0, img.size(), thresh, nms);
+}
+
+vector<bbox_t> DarknetBackend::detect(const FrameBuffer& frame, float thresh, bool /*useMean*/, int inputSize) {
+	NetInput& netInput = *netInputs[inputSize];
+	if (!netInput.set(frame))
+		return vector<bbox_t>();
+	network_predict_ptr(networks[inputSize], netInput.getImage().data);
+	return getBboxes(networks[inputSize], 0, Size(frame.width, frame.height), thresh, nms);
+}
+
+void DarknetBackend::detectBatch(const vector<Mat>& imgs, vector<vector<bbox_t>>& bboxesList, float thresh, bool useMean) {
+	if (imgs.size() < 2) {
+		InferenceBackend::detectBatch(imgs, bboxesList, thresh, useMean);
+		return;
+	}
+	bboxesList.clear();
+	bboxesList.resize(imgs.size());
+
+	// darknet averages the 2 images of batch 2 as an image and its flip, so a batch has at least 3
+	int batch = max((int)imgs.size(), 3);
+	if (batchNetwork == nullptr || batchNetwork->batch < batch) {
+		DarknetNetwork* network = loadNetwork(0, 0, batch);
+		if (network == nullptr) {
+			InferenceBackend::detectBatch(imgs, bboxesList, thresh, useMean);
+			return;
+		}
+		if (batchNetwork != nullptr)
+			keepIdleNetwork(getNetworkKey(0, 0, batchNetwork->batch), batchNetwork);
+		batchNetwork = network;
+	}
+
+	// network inputs of all images are prepared in parallel into one buffer, slots of images left out are ignored
+	size_t inputSize = (size_t)netInputs[0]->width * netInputs[0]->height * 3;
+	batchData.resize(inputSize * batchNetwork->batch);
+	while (batchInputs.size() < imgs.size())
+		batchInputs.emplace_back(netInputs[0]->width, netInputs[0]->height);
+	vector<char> prepared(imgs.size(), 0);
+	parallel_for_(Range(0, (int)imgs.size()), [&](const Range& range) {
+		for (int i = range.start; i < range.end; i++) {
+			prepared[i] = batchInputs[i].set(imgs[i]);
+			if (prepared[i])
+				memcpy(batchData.data() + inputSize * i, batchInputs[i].getImage().data, inputSize * sizeof(float));
+		}
+	});
+
+	network_predict_ptr(batchNetwork, batchData.data());
+	for (size_t i = 0; i < imgs.size(); i++) {
+		if (prepared[i])
+			bboxesList[i] = getBboxes(batchNetwork, (int)i, imgs[i].size(), thresh, nms);
+		else if (imgs[i].data != NULL)
+			bboxesList[i] = detect(imgs[i], thresh, useMean);
+	}
+}
+
+OpenCVDnnBackend::OpenCVDnnBackend(const string& cfgFileName, const string& weightFileName) {
+	net = dnn::readNetFromDarknet(cfgFileName, weightFileName);
+	net.setPreferableBackend(dnn::DNN_BACKEND_OPENCV);
+	net.setPreferableTarget(dnn::DNN_TARGET_CPU);
+	outLayerNames = net.getUnconnectedOutLayersNames();
+
+	// network input size isn't exposed by dnn::Net, read it from cfg
+	Size size = readCfgInputSize(cfgFileName);
+	netInputs.emplace_back(new NetInput(size.width, size.height));
+}
+
+int OpenCVDnnBackend::addInputSize(int width, int height) {
+	netInputs.emplace_back(new NetInput(width, height));
+	return (int)netInputs.size() - 1;
+}
+
+vector<bbox_t> OpenCVDnnBackend::detect(const Mat& img, float thresh, bool /*useMean*/, int inputSize) {
+	if (img.data == NULL)
+		throw runtime_error("Image is empty");
+
+	Mat blob;
+	NetInput& netInput = *netInputs[inputSize];
+	if (netInput.set(img))
+		blob = netInput.getBlob();
+	else
+		blob = dnn::blobFromImage(img, 1 / 255.0, Size(netInput.width, netInput.height), Scalar(), true, false);
+	return forward(blob, img.size(), thresh);
+}
+
+vector<bbox_t> OpenCVDnnBackend::detect(const FrameBuffer& frame, float thresh, bool /*useMean*/, int inputSize) {
+	NetInput& netInput = *netInputs[inputSize];
+	if (!netInput.set(frame))
+		return vector<bbox_t>();
+	return forward(netInput.getBlob(), Size(frame.width, frame.height), thresh);
+}
+
+vector<bbox_t> OpenCVDnnBackend::forward(const Mat& blob, Size imageSize, float thresh) {
+	net.setInput(blob);
+	vector<Mat> outs;
+	net.forward(outs, outLayerNames);
+
+	// each row of yolo outputs is [center x, center y, width, height, objectness, class probabilities...] in relative
+	vector<vector<Rect>> classBoxes;
+	vector<vector<float>> classProbs;
+	for (const Mat& out : outs) {
+		int numClasses = out.cols - 5;
+		if ((int)classBoxes.size() < numClasses) {
+			classBoxes.resize(numClasses);
+			classProbs.resize(numClasses);
+		}
+		for (int row = 0; row < out.rows; row++) {
+			const float* data = out.ptr<float>(row);
+			for (int cls = 0; cls < numClasses; cls++) {
+				float prob = data[5 + cls];
+				if (prob <= thresh)
+					continue;
+				int w = (int)(data[2] * imageSize.width);
+				int h = (int)(data[3] * imageSize.height);
+				int x = (int)(data[0] * imageSize.width) - w / 2;
+				int y = (int)(data[1] * imageSize.height) - h / 2;
+				classBoxes[cls].push_back(Rect(x, y, w, h));
+				classProbs[cls].push_back(prob);
+			}
+		}
+	}
+
+	vector<bbox_t> bboxes;
+	for (size_t cls = 0; cls < classBoxes.size(); cls++) {
+		vector<int> indices;
+		dnn::NMSBoxes(classBoxes[cls], classProbs[cls], thresh, nms, indices);
+		for (int index : indices) {
+			Rect box = classBoxes[cls][index] & Rect(0, 0, imageSize.width, imageSize.height);
+			bbox_t bbox = {};
+			bbox.x = box.x;
+			bbox.y = box.y;
+			bbox.w = box.width;
+			bbox.h = box.height;
+			bbox.prob = classProbs[cls][index];
+			bbox.obj_id = (unsigned int)cls;
+			bboxes.push_back(bbox);
+		}
+	}
+	return bboxes;
+}
+
+unique_ptr<InferenceBackend> createInferenceBackend(const string& name, const string& cfgFileName,
+	const string& weightFileName, int gpuId) {
+	// int8 backend folds batch normalization itself, and its calibration is named after the original weights
+	if (name.compare("int8") == 0) {
+		unique_ptr<QuantizedBackend> backend(new QuantizedBackend(cfgFileName, weightFileName));
+		if (!*backend)
+			return nullptr;
+		return backend;
+	}
+
+	string modelCfgFileName = cfgFileName, modelWeightFileName = weightFileName;
+	bool fused = useFusedModel(modelCfgFileName, modelWeightFileName);
+	if (fused)
+		cout << "fused model " << modelWeightFileName << " is used" << endl;
+
+	if (name.compare("darknet") == 0)
+		return unique_ptr<InferenceBackend>(new DarknetBackend(modelCfgFileName, modelWeightFileName, gpuId, fused));
+	else if (name.compare("opencv") == 0)
+		return unique_ptr<InferenceBackend>(new OpenCVDnnBackend(modelCfgFileName, modelWeightFileName));
+	cerr << "There is no inference backend " << name << endl;
+	return nullptr;
+}
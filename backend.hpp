@@ -0,0 +1,176 @@
+#ifndef __BACKEND_HPP
+#define __BACKEND_HPP
+
+#define OPENCV
+#include <yolo_v2_class.hpp>
+
+#include <opencv2/dnn.hpp>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+enum class PixelFormat { BGR, RGB, GRAY, NV12, I420 };
+
+// frame in an external buffer, pixels are read where they are without copying.
+// NV12 has Y plane and interleaved UV plane, I420 has Y, U and V planes. chroma planes are half size of Y plane
+class FrameBuffer {
+public:
+	PixelFormat format;
+	int width;
+	int height;
+	const unsigned char* planes[3];
+	size_t strides[3]; // in bytes
+
+	// planes of contiguous layout, chroma planes follow Y plane. planes and strides may be set after for other layouts
+	FrameBuffer(const void* data, int width, int height, size_t stride, PixelFormat format);
+};
+
+// reusable network input, planar RGB float(0~1) of width x height as darknet and dnn blob expect
+class NetInput {
+	// per output column, offsets of left/right source samples in a row and weight of the right one
+	class ColumnTable {
+	public:
+		std::vector<int> offsets0;
+		std::vector<int> offsets1;
+		std::vector<float> weights;
+		int srcWidth = 0;
+		int step = 0;
+
+		void set(int dstWidth, int srcWidth, int step);
+	};
+
+	std::vector<float> data;
+	ColumnTable columns;
+	ColumnTable chromaColumns;
+
+	// rows of packed 8 bit pixels, srcChannels is the channel of each RGB plane
+	void setPacked(const unsigned char* pixels, size_t stride, int srcWidth, int srcHeight, int channels, const int srcChannels[3]);
+	void setYuv(const FrameBuffer& frame);
+
+public:
+	const int width;
+	const int height;
+
+	NetInput(int width, int height) : data((size_t)width * height * 3), width(width), height(height) {}
+
+	// bilinear resize, BGR to RGB, scale to 0~1 and split into planes in one pass.
+	// img shall be CV_8UC1, CV_8UC3 or CV_8UC4(BGRA), return false for other types
+	bool set(const cv::Mat& img);
+	// same as set(Mat) for any PixelFormat, YUV to RGB(BT.601) is done in the same pass
+	bool set(const FrameBuffer& frame);
+	// image_t pointing the buffer, valid until next set()
+	image_t getImage() {
+		image_t img;
+		img.w = width;
+		img.h = height;
+		img.c = 3;
+		img.data = data.data();
+		return img;
+	}
+	// 1x3xheightxwidth blob header pointing the buffer, valid until next set()
+	cv::Mat getBlob() {
+		int sizes[] = { 1, 3, height, width };
+		return cv::Mat(4, sizes, CV_32F, data.data());
+	}
+};
+
+// network runtime which finds marker boxes of an image, not thread safe.
+// it may run at several input sizes, input size 0 is the one of cfg
+class InferenceBackend {
+public:
+	virtual ~InferenceBackend() {}
+
+	virtual std::string getName() const = 0;
+	virtual int getNumInputSizes() const = 0;
+	virtual int getNetWidth(int inputSize = 0) const = 0;
+	virtual int getNetHeight(int inputSize = 0) const = 0;
+	// add network input size, return its index or -1 if it fails
+	virtual int addInputSize(int width, int height) = 0;
+
+	// boxes are in image coordinates
+	virtual std::vector<bbox_t> detect(const cv::Mat& img, float thresh = 0.2, bool use_mean = false, int inputSize = 0) = 0;
+	// frame is converted straight into network input, return empty if frame isn't valid
+	virtual std::vector<bbox_t> detect(const FrameBuffer& frame, float thresh = 0.2, bool use_mean = false, int inputSize = 0) = 0;
+	// bboxesList[i] is the boxes of imgs[i], runs at input size 0
+	virtual void detectBatch(const std::vector<cv::Mat>& imgs, std::vector<std::vector<bbox_t>>& bboxesList,
+		float thresh = 0.2, bool use_mean = false);
+};
+
+struct DarknetNetwork;
+class MappedFile;
+
+// runs darknet through its C API(darknetapi.hpp), use_mean is ignored. darknet can't resize a loaded network, so each
+// input size loads its own network, and batches run on one more network of input size 0 loaded with the batch size.
+// networks after the first one point at its convolutional weights in host memory instead of holding their own,
+// only their layer buffers(and weights in GPU memory) are per network. weights of a fused model are mapped instead,
+// so they are also shared with other processes and aren't read from the file on CPU
+class DarknetBackend : public InferenceBackend {
+	std::string cfgFileName;
+	std::string weightFileName;
+	int gpuId;
+	const MappedFile* mappedWeights = nullptr; // every network points at it if it is set
+	std::vector<DarknetNetwork*> networks; // one per input size, of batch 1
+	std::vector<std::unique_ptr<NetInput>> netInputs;
+	DarknetNetwork* batchNetwork = nullptr;
+	std::vector<NetInput> batchInputs;
+	std::vector<float> batchData; // network inputs of a batch in a row
+
+	std::string getNetworkKey(int width, int height, int batch) const;
+	// network of width x height(of cfg if 0) running batch images in one forward pass, nullptr if it fails
+	DarknetNetwork* loadNetwork(int width, int height, int batch);
+
+public:
+	float nms = .4f;
+
+	// weights of fused model(compileFusedModel) are mapped if mapWeights is set
+	DarknetBackend(const std::string& cfgFileName, const std::string& weightFileName, int gpuId = 0, bool mapWeights = false);
+	// dark.dll can't free a network, so networks are kept for later backends of the same model
+	~DarknetBackend();
+
+	std::string getName() const override { return "darknet"; }
+	int getNumInputSizes() const override { return (int)networks.size(); }
+	int getNetWidth(int inputSize = 0) const override { return netInputs[inputSize]->width; }
+	int getNetHeight(int inputSize = 0) const override { return netInputs[inputSize]->height; }
+	// loads another network from a copy of cfg with the new size, sharing weights of the first network
+	int addInputSize(int width, int height) override;
+
+	std::vector<bbox_t> detect(const cv::Mat& img, float thresh = 0.2, bool use_mean = false, int inputSize = 0) override;
+	std::vector<bbox_t> detect(const FrameBuffer& frame, float thresh = 0.2, bool use_mean = false, int inputSize = 0) override;
+	// images are packed into one input buffer and run in one forward pass
+	void detectBatch(const std::vector<cv::Mat>& imgs, std::vector<std::vector<bbox_t>>& bboxesList,
+		float thresh = 0.2, bool use_mean = false) override;
+};
+
+// runs darknet cfg/weights with OpenCV's dnn module on CPU, use_mean is ignored.
+// all input sizes share one loaded network which is reshaped by the input blob
+class OpenCVDnnBackend : public InferenceBackend {
+	cv::dnn::Net net;
+	std::vector<std::string> outLayerNames;
+	std::vector<std::unique_ptr<NetInput>> netInputs; // one per input size
+
+public:
+	float nms = .4f;
+
+	OpenCVDnnBackend(const std::string& cfgFileName, const std::string& weightFileName);
+
+	std::string getName() const override { return "opencv"; }
+	int getNumInputSizes() const override { return (int)netInputs.size(); }
+	int getNetWidth(int inputSize = 0) const override { return netInputs[inputSize]->width; }
+	int getNetHeight(int inputSize = 0) const override { return netInputs[inputSize]->height; }
+	int addInputSize(int width, int height) override;
+
+	std::vector<bbox_t> detect(const cv::Mat& img, float thresh = 0.2, bool use_mean = false, int inputSize = 0) override;
+	std::vector<bbox_t> detect(const FrameBuffer& frame, float thresh = 0.2, bool use_mean = false, int inputSize = 0) override;
+
+private:
+	// boxes of network input blob, in coordinates of image of imageSize
+	std::vector<bbox_t> forward(const cv::Mat& blob, cv::Size imageSize, float thresh);
+};
+
+// create backend by name("darknet", "opencv" or "int8"), return nullptr if name is unknown or loading fails.
+// fused model compiled from weightFileName is loaded instead if it is up to date
+std::unique_ptr<InferenceBackend> createInferenceBackend(const std::string& name, const std::string& cfgFileName,
+	const std::string& weightFileName, int gpuId = 0);
+
+#endif
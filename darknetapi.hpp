@@ -0,0 +1,125 @@
+#ifndef __DARKNETAPI_HPP
+#define __DARKNETAPI_HPP
+
+// part of darknet C API exported by dark.dll. darknet.h can't be included since it needs pthread.h, so the functions
+// are declared here and structs are mirrored up to the members used, in the same order as darknet.h of 3rdparty.
+// spans of members which aren't used are kept as arrays of the same types, so offsets stay the same
+
+// leading members of network, GPU members come after them
+struct DarknetNetwork {
+	int n; // number of layers
+	int batch;
+	void* seen;
+	void* t;
+	float epoch;
+	int subdivisions;
+	void* layers;
+	float* output;
+	int policy;
+	float learningRate[3]; // learning_rate ~ learning_rate_max
+	int batchesPerCycle[2]; // batches_per_cycle, batches_cycle_mult
+	float momentum[5]; // momentum ~ power
+	int timeSteps[3]; // time_steps ~ max_batches
+	void* seqScales[3]; // seq_scales ~ steps
+	int numSteps[4]; // num_steps ~ adam
+	float b1[3]; // B1 ~ eps
+	int inputs;
+	int outputs;
+	int truths;
+	int notruth;
+	int h, w, c;
+	int maxCrop[2]; // max_crop, min_crop
+	float maxRatio[2]; // max_ratio, min_ratio
+	int center[5]; // center ~ letter_box
+	float angle[5]; // angle ~ hue
+	int random[7]; // random ~ try_fix_nan
+	int gpu_index; // -1 if network runs on CPU
+};
+
+// values of LAYER_TYPE
+enum DarknetLayerType { DARKNET_CONVOLUTIONAL = 0, DARKNET_DETECTION = 5, DARKNET_REGION = 24, DARKNET_YOLO = 25 };
+
+// leading members of layer, GPU members come after them
+struct DarknetLayer {
+	int type;
+	int activation;
+	int costType;
+	void* functions[6]; // forward ~ update_gpu
+	void* shareLayer;
+	int batch_normalize;
+	int shortcut;
+	int batch;
+	int forced;
+	int flipped;
+	int inputs;
+	int outputs; // of an image, output holds batch of them
+	int nweights;
+	int nbiases;
+	int extra;
+	int truths;
+	int h, w, c;
+	int out_h, out_w, out_c;
+	int n; // filters of convolutional layer
+	int maxBoxes[23]; // max_boxes ~ truth
+	float smooth[10]; // smooth ~ clip
+	int focalLoss[14]; // focal_loss ~ tanh
+	int* mask;
+	int total;
+	float bflops;
+	int adam[30]; // adam ~ scale, ints and floats
+	void* cweights[19]; // cweights ~ binary_weights
+	float* biases;
+	float* bias_updates;
+	float* scales;
+	float* scale_updates;
+	float* weights;
+	float* weight_updates;
+	float scaleXY[4]; // scale_x_y ~ iou_loss
+	void* alignBitWeightsGpu[4]; // align_bit_weights_gpu ~ transposed_align_workspace_gpu
+	int align_workspace_size;
+	void* alignBitWeights[2]; // align_bit_weights, mean_arr
+	int alignBitWeightsSize[4]; // align_bit_weights_size ~ bit_align
+	float* col_image;
+	float* delta;
+	float* output;
+	float* output_sigmoid;
+	int delta_pinned;
+	int output_pinned;
+	float* loss[8]; // loss ~ variance_delta
+	float* rolling_mean;
+	float* rolling_variance;
+};
+
+struct DarknetBox {
+	float x, y, w, h;
+};
+
+struct DarknetDetection {
+	DarknetBox bbox;
+	int classes;
+	float* prob;
+	float* mask;
+	float objectness;
+	int sort_class;
+};
+
+extern "C" {
+// weights aren't loaded if weights is empty
+DarknetNetwork* load_network_custom(char* cfg, char* weights, int clear, int batch);
+// input is batch images of network size, planar RGB(0~1)
+float* network_predict_ptr(DarknetNetwork* net, float* input);
+// boxes of the first image of batch, relative to image if relative is 1
+DarknetDetection* get_network_boxes(DarknetNetwork* net, int w, int h, float thresh, float hier, int* map, int relative, int* num, int letter);
+void do_nms_sort(DarknetDetection* dets, int total, int classes, float thresh);
+void free_detections(DarknetDetection* dets, int n);
+DarknetLayer* get_network_layer(DarknetNetwork* net, int i);
+// net is taken by value, only n and layers are read from it and they are in the mirrored part
+void fuse_conv_batchnorm(DarknetNetwork net);
+int network_width(DarknetNetwork* net);
+int network_height(DarknetNetwork* net);
+void cuda_set_device(int n);
+// number of CUDA devices, -1 if dark.dll is built without GPU
+int get_device_count();
+}
+
+#endif
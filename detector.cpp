@@ -2,15 +2,492 @@
 #include "utility.hpp"
 
 #include <fstream>
-#include <map>
+#include <algorithm>
 
 using namespace cv;
 using namespace std;
 
+void DetectionResult::scaleTo(Size2i size) {
+	if (size == imageSize || imageSize.area() == 0)
+		return;
+	double ratioX = (double)size.width / imageSize.width;
+	double ratioY = (double)size.height / imageSize.height;
+	for (MarkerI& marker : markers)
+		marker.location = Point2i((int)round(marker.location.x * ratioX), (int)round(marker.location.y * ratioY));
+	for (float& x : winStruct.xs)
+		x = (float)(x * ratioX);
+	for (float& y : winStruct.ys)
+		y = (float)(y * ratioY);
+	imageSize = size;
+}
+
+Mat WinDetector::readImage(const string& imgFileName, Size2i& fullSize) const {
+	string ext = imgFileName.substr(imgFileName.rfind('.') + 1, string::npos);
+	for (char& c : ext)
+		c = (char)tolower(c);
+	Size2i headerSize;
+	if (resolutionsBySize.empty() || (ext.compare("jpg") != 0 && ext.compare("jpeg") != 0) || readJpegSize(imgFileName, headerSize) < 0) {
+		Mat img = imread(imgFileName);
+		fullSize = img.size();
+		return img;
+	}
+
+	// largest DCT scaling whose result still covers network input
+	// largest resolution decides the size, so the same image can be detected at any resolution
+	Size2i netSize = getResolution(resolutionsBySize.back());
+	const int minWidth = (int)ceil(netSize.width * REDUCED_DECODE_MIN_NET_RATIO);
+	const int minHeight = (int)ceil(netSize.height * REDUCED_DECODE_MIN_NET_RATIO);
+	const int reductions[] = { 8, 4, 2 };
+	const int flags[] = { IMREAD_REDUCED_COLOR_8, IMREAD_REDUCED_COLOR_4, IMREAD_REDUCED_COLOR_2 };
+	int flag = IMREAD_COLOR;
+	for (int i = 0; i < 3; i++) {
+		if (headerSize.width / reductions[i] >= minWidth && headerSize.height / reductions[i] >= minHeight) {
+			flag = flags[i];
+			break;
+		}
+	}
+
+	Mat img = imread(imgFileName, flag);
+	fullSize = headerSize;
+	// imread applies exif orientation but jpg header has the size before it
+	if ((img.cols > img.rows) != (fullSize.width > fullSize.height))
+		swap(fullSize.width, fullSize.height);
+	return img;
+}
+
 int WinDetector::detect(const string& imgFileName, WindowStructure& winStruct, bool showMarker, float thresh, bool useMean) {
-	vector<bbox_t> bboxes = this->Detector::detect(imgFileName, thresh, useMean);
+	Size2i fullSize;
+	Mat img = readImage(imgFileName, fullSize);
+	if (img.data == NULL) {
+		cerr << "img file " << imgFileName << " load fail" << endl;
+		return -1;
+	}
+	vector<bbox_t> bboxes = detectMarkerBoxes(img, thresh, useMean);
+
+	DetectionResult result;
+	int ret = detectFromMarkerBoxes(img, bboxes, fullSize, result, showMarker, imgFileName);
+	winStruct += result.winStruct;
+	return ret;
+}
+
+int WinDetector::detect(const string& imgFileName, DetectionResult& result, float thresh, bool useMean) {
+	Size2i fullSize;
+	Mat img = readImage(imgFileName, fullSize);
+	if (img.data == NULL) {
+		cerr << "img file " << imgFileName << " load fail" << endl;
+		return -1;
+	}
+	vector<bbox_t> bboxes = detectMarkerBoxes(img, thresh, useMean);
+	return detectFromMarkerBoxes(img, bboxes, fullSize, result);
+}
+
+int WinDetector::detect(const Mat& img, WindowStructure& winStruct, bool showMarker, float thresh, bool useMean,
+	const string& imgFileName) {
+	if (img.data == NULL) {
+		cerr << "img is empty" << endl;
+		return -1;
+	}
+	vector<bbox_t> bboxes = detectMarkerBoxes(img, thresh, useMean);
+
+	DetectionResult result;
+	int ret = detectFromMarkerBoxes(img, bboxes, result, showMarker, imgFileName);
+	winStruct += result.winStruct;
+	return ret;
+}
+
+int WinDetector::detect(const Mat& img, DetectionResult& result, float thresh, bool useMean, int resolution) {
+	if (img.data == NULL) {
+		cerr << "img is empty" << endl;
+		return -1;
+	}
+	vector<bbox_t> bboxes = detectMarkerBoxes(img, thresh, useMean, resolution);
+	return detectFromMarkerBoxes(img, bboxes, result);
+}
+
+int WinDetector::detect(const FrameBuffer& frame, DetectionResult& result, float thresh, bool useMean, int resolution) {
+	if (frame.planes[0] == nullptr || frame.width <= 0 || frame.height <= 0) {
+		cerr << "frame is empty" << endl;
+		return -1;
+	}
+	vector<bbox_t> bboxes = detectMarkerBoxes(frame, thresh, useMean, resolution);
+	// only size of image is used without showMarker, a header on first plane is enough
+	Mat header(frame.height, frame.width, CV_8UC1, (void*)frame.planes[0], frame.strides[0]);
+	return detectFromMarkerBoxes(header, bboxes, result);
+}
+
+int WinDetector::detectTiled(const string& imgFileName, DetectionResult& result, float thresh, bool useMean,
+	size_t maxMemory, bool batch) {
+	Size2i fullSize;
+	int flag = IMREAD_COLOR;
+	if (readJpegSize(imgFileName, fullSize) == 0) {
+		// smallest DCT scaling whose decoded image fits half of maxMemory
+		const int reductions[] = { 1, 2, 4, 8 };
+		const int flags[] = { IMREAD_COLOR, IMREAD_REDUCED_COLOR_2, IMREAD_REDUCED_COLOR_4, IMREAD_REDUCED_COLOR_8 };
+		for (int i = 0; i < 4; i++) {
+			flag = flags[i];
+			if ((size_t)(fullSize.width / reductions[i]) * (fullSize.height / reductions[i]) * 3 <= maxMemory / 2)
+				break;
+		}
+	}
+
+	Mat img = imread(imgFileName, flag);
+	if (img.data == NULL) {
+		cerr << "img file " << imgFileName << " load fail" << endl;
+		return -1;
+	}
+	if (fullSize.area() == 0)
+		fullSize = img.size();
+	else if ((img.cols > img.rows) != (fullSize.width > fullSize.height)) // exif orientation is applied by imread
+		swap(fullSize.width, fullSize.height);
+
+	vector<bbox_t> bboxes = detectTiledBoxes(img, thresh, useMean, maxMemory, batch);
+	return detectFromMarkerBoxes(img, bboxes, fullSize, result);
+}
+
+int WinDetector::detectTiled(const Mat& img, DetectionResult& result, float thresh, bool useMean, size_t maxMemory, bool batch) {
+	if (img.data == NULL) {
+		cerr << "img is empty" << endl;
+		return -1;
+	}
+	vector<bbox_t> bboxes = detectTiledBoxes(img, thresh, useMean, maxMemory, batch);
+	return detectFromMarkerBoxes(img, bboxes, result);
+}
+
+// pieces of a marker cut by tile edges are dropped if a tile has the marker whole(a box of same class overlapping them),
+// otherwise pieces of same class which overlap are merged into their union. pieces of a marker larger than
+// TILE_OVERLAP overlap each other within the overlap of their tiles
+static void mergeCutBoxes(vector<bbox_t>& bboxes, const vector<bbox_t>& cutBboxes) {
+	auto toRect = [](const bbox_t& bbox) { return Rect((int)bbox.x, (int)bbox.y, (int)bbox.w, (int)bbox.h); };
+	vector<bbox_t> pieces;
+	for (const bbox_t& cut : cutBboxes) {
+		bool whole = false;
+		for (const bbox_t& bbox : bboxes)
+			whole = whole || (bbox.obj_id == cut.obj_id && (toRect(bbox) & toRect(cut)).area() > 0);
+		if (!whole)
+			pieces.push_back(cut);
+	}
 
-	vector<MarkerI> markers;
+	// a union may come to overlap a piece it didn't before, so merge until nothing changes
+	for (bool merged = true; merged;) {
+		merged = false;
+		for (size_t i = 0; i < pieces.size(); i++) {
+			for (size_t j = i + 1; j < pieces.size(); j++) {
+				if (pieces[i].obj_id != pieces[j].obj_id || (toRect(pieces[i]) & toRect(pieces[j])).area() == 0)
+					continue;
+				Rect joined = toRect(pieces[i]) | toRect(pieces[j]);
+				pieces[i].x = joined.x;
+				pieces[i].y = joined.y;
+				pieces[i].w = joined.width;
+				pieces[i].h = joined.height;
+				pieces[i].prob = max(pieces[i].prob, pieces[j].prob);
+				pieces.erase(pieces.begin() + j);
+				merged = true;
+				j = i;
+			}
+		}
+	}
+	bboxes.insert(bboxes.end(), pieces.begin(), pieces.end());
+}
+
+vector<bbox_t> WinDetector::detectTiledBoxes(const Mat& img, float thresh, bool useMean, size_t maxMemory, bool batch) {
+	// tile origins along one axis, last tile is aligned to the end of image
+	auto getTileOrigins = [](int length, int tileLength) {
+		vector<int> origins;
+		int stride = max(1, tileLength - TILE_OVERLAP);
+		for (int origin = 0; ; origin += stride) {
+			if (origin + tileLength >= length) {
+				origins.push_back(max(0, length - tileLength));
+				break;
+			}
+			origins.push_back(origin);
+		}
+		return origins;
+	};
+	Size2i tileSize = getResolution(0);
+	vector<Rect> tiles;
+	for (int y : getTileOrigins(img.rows, tileSize.height))
+		for (int x : getTileOrigins(img.cols, tileSize.width))
+			tiles.push_back(Rect(x, y, tileSize.width, tileSize.height) & Rect(0, 0, img.cols, img.rows));
+
+	// each tile of a batch holds a planar float network input
+	size_t imgBytes = img.total() * img.elemSize();
+	size_t tileBytes = (size_t)tileSize.area() * 3 * sizeof(float);
+	size_t batchSize = 1;
+	if (batch && maxMemory > imgBytes)
+		batchSize = max((size_t)1, min(tiles.size(), (maxMemory - imgBytes) / tileBytes));
+
+	vector<bbox_t> bboxes, cutBboxes;
+	for (size_t begin = 0; begin < tiles.size(); begin += batchSize) {
+		size_t end = min(tiles.size(), begin + batchSize);
+		vector<Mat> tileImgs;
+		for (size_t i = begin; i < end; i++)
+			tileImgs.push_back(img(tiles[i])); // header only, pixels aren't copied
+		vector<vector<bbox_t>> tileBboxes;
+		{
+			lock_guard<mutex> lock(networkMutex);
+			if (batchSize > 1)
+				backend->detectBatch(tileImgs, tileBboxes, thresh, useMean);
+			else
+				tileBboxes.push_back(backend->detect(tileImgs[0], thresh, useMean));
+		}
+
+		for (size_t i = begin; i < end; i++) {
+			const Rect& tile = tiles[i];
+			for (bbox_t bbox : tileBboxes[i - begin]) {
+				// box cut by a tile edge inside image is kept apart until every tile is done
+				bool cutLeft = tile.x > 0 && bbox.x <= 1;
+				bool cutTop = tile.y > 0 && bbox.y <= 1;
+				bool cutRight = tile.br().x < img.cols && (int)(bbox.x + bbox.w) >= tile.width - 1;
+				bool cutBottom = tile.br().y < img.rows && (int)(bbox.y + bbox.h) >= tile.height - 1;
+				bbox.x += tile.x;
+				bbox.y += tile.y;
+				if (cutLeft || cutTop || cutRight || cutBottom)
+					cutBboxes.push_back(bbox);
+				else
+					bboxes.push_back(bbox);
+			}
+		}
+	}
+	mergeCutBoxes(bboxes, cutBboxes);
+
+	// markers found whole in several tiles are merged by redundant marker removal
+	return bboxes;
+}
+
+future<DetectionResult> WinDetector::detectAsync(Mat img, float thresh, bool useMean, int resolution) {
+	call_once(asyncWorkersStarted, [this] {
+		for (int i = 0; i < ASYNC_DETECT_WORKERS; i++) {
+			asyncWorkers.push_back(thread([this] {
+				for (packaged_task<DetectionResult()> job; asyncJobs.pop(job);)
+					job();
+			}));
+		}
+	});
+
+	packaged_task<DetectionResult()> job([this, img, thresh, useMean, resolution] {
+		DetectionResult result;
+		if (detect(img, result, thresh, useMean, resolution) < 0)
+			throw runtime_error("fail to detect image");
+		return result;
+	});
+	future<DetectionResult> ret = job.get_future();
+	asyncJobs.push(move(job));
+	return ret;
+}
+
+template<class Image>
+vector<bbox_t> WinDetector::detectBoxesOf(const Image& img, float thresh, bool useMean, int resolution) {
+	resolution = resolveResolution(resolution);
+
+	vector<bbox_t> bboxes;
+	double elapsed;
+	{
+		lock_guard<mutex> lock(networkMutex);
+		auto start = chrono::steady_clock::now();
+		bboxes = backend->detect(img, thresh, useMean, resolution);
+		elapsed = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+	}
+
+	lock_guard<mutex> lock(latencyMutex);
+	double& latency = resolutionLatencies[resolution];
+	latency = latency == 0 ? elapsed : latency + (elapsed - latency) * RESOLUTION_LATENCY_SMOOTHING;
+	return bboxes;
+}
+
+template<class Image>
+vector<bbox_t> WinDetector::detectMarkerBoxesOf(const Image& img, float thresh, bool useMean, int resolution) {
+	if (!cascadeBackend)
+		return detectBoxesOf(img, thresh, useMean, resolution);
+
+	vector<bbox_t> bboxes;
+	{
+		lock_guard<mutex> lock(cascadeMutex);
+		auto start = chrono::steady_clock::now();
+		bboxes = cascadeBackend->detect(img, thresh, useMean);
+		cascadeStats.tinyMs += chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+		cascadeStats.frames++;
+	}
+	if (isEnoughForSurfaces(bboxes)) {
+		lock_guard<mutex> lock(cascadeMutex);
+		cascadeStats.hits++;
+		return bboxes;
+	}
+
+	auto start = chrono::steady_clock::now();
+	bboxes = detectBoxesOf(img, thresh, useMean, resolution);
+	double elapsed = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+	lock_guard<mutex> lock(cascadeMutex);
+	cascadeStats.fullMs += elapsed;
+	return bboxes;
+}
+
+vector<bbox_t> WinDetector::detectBoxes(const Mat& img, float thresh, bool useMean, int resolution) {
+	return detectBoxesOf(img, thresh, useMean, resolution);
+}
+
+vector<bbox_t> WinDetector::detectBoxes(const FrameBuffer& frame, float thresh, bool useMean, int resolution) {
+	return detectBoxesOf(frame, thresh, useMean, resolution);
+}
+
+vector<bbox_t> WinDetector::detectMarkerBoxes(const Mat& img, float thresh, bool useMean, int resolution) {
+	return detectMarkerBoxesOf(img, thresh, useMean, resolution);
+}
+
+vector<bbox_t> WinDetector::detectMarkerBoxes(const FrameBuffer& frame, float thresh, bool useMean, int resolution) {
+	return detectMarkerBoxesOf(frame, thresh, useMean, resolution);
+}
+
+bool WinDetector::isEnoughForSurfaces(const vector<bbox_t>& bboxes) const {
+	if (bboxes.empty())
+		return false;
+
+	ScratchArena arena;
+	// number of distinct confident marker ids per surface, -1 if no marker of the surface is found
+	pmr::vector<bbox_t> sorted(bboxes.begin(), bboxes.end(), &arena);
+	sort(sorted.begin(), sorted.end(), [](const bbox_t& a, const bbox_t& b) { return a.obj_id < b.obj_id; });
+	pmr::vector<int> confidentCounts(surfaces.size(), -1, &arena);
+	for (size_t begin = 0, end; begin < sorted.size(); begin = end) {
+		bool confident = false;
+		for (end = begin; end < sorted.size() && sorted[end].obj_id == sorted[begin].obj_id; end++)
+			confident = confident || sorted[end].prob >= CASCADE_MIN_MARKER_PROB;
+
+		int id = (int)sorted[begin].obj_id;
+		if (id >= (int)markerIndexToSurface.size() || markerIndexToSurface[id] < 0)
+			continue;
+		int& count = confidentCounts[markerIndexToSurface[id]];
+		count = max(count, 0) + (confident ? 1 : 0);
+	}
+
+	bool touched = false;
+	for (int count : confidentCounts) {
+		if (count < 0)
+			continue;
+		touched = true;
+		if (count < 4)
+			return false;
+	}
+	return touched;
+}
+
+CascadeStats WinDetector::getCascadeStats() {
+	lock_guard<mutex> lock(cascadeMutex);
+	return cascadeStats;
+}
+
+void WinDetector::printCascadeStats() {
+	CascadeStats stats = getCascadeStats();
+	cout << "cascade hit rate: " << stats.getHitRate() * 100 << "% (" << stats.hits << "/" << stats.frames << "), "
+		<< "tiny model: " << stats.tinyMs << "ms, full model: " << stats.fullMs << "ms, saved: " << stats.getSavedMs() << "ms" << endl;
+}
+
+int WinDetector::resolveResolution(int resolution) {
+	if (resolution == RESOLUTION_AUTO)
+		return selectResolutionByQueue();
+	if (resolution < 0 || resolution >= getNumResolutions()) {
+		cerr << "There is no resolution " << resolution << ", resolution 0 is used" << endl;
+		return 0;
+	}
+	return resolution;
+}
+
+Size2i WinDetector::getResolution(int resolution) const {
+	return Size2i(backend->getNetWidth(resolution), backend->getNetHeight(resolution));
+}
+
+int WinDetector::selectResolution(double latencyBudgetMs) {
+	lock_guard<mutex> lock(latencyMutex);
+	int measured = -1;
+	for (size_t i = 0; i < resolutionLatencies.size(); i++) {
+		if (resolutionLatencies[i] > 0) {
+			measured = (int)i;
+			break;
+		}
+	}
+	if (measured < 0)
+		return 0;
+
+	double latencyPerArea = resolutionLatencies[measured] / getResolution(measured).area();
+	int selected = resolutionsBySize[0];
+	for (int resolution : resolutionsBySize) {
+		double latency = resolutionLatencies[resolution];
+		if (latency == 0)
+			latency = latencyPerArea * getResolution(resolution).area();
+		if (latency <= latencyBudgetMs)
+			selected = resolution;
+	}
+	return selected;
+}
+
+int WinDetector::selectResolutionByQueue() {
+	int steps = (int)(asyncJobs.size() / AUTO_RESOLUTION_QUEUE_STEP);
+	return resolutionsBySize[max(0, (int)resolutionsBySize.size() - 1 - steps)];
+}
+
+int WinDetector::setResolutions() {
+	Size2i cfgSize = getResolution(0);
+	for (int width : resolutionWidths) {
+		if (width <= 0 || width % 32 != 0) {
+			cerr << "resolution " << width << " shall be a positive multiple of 32" << endl;
+			return -1;
+		}
+		int height = max(32, (int)round((double)width * cfgSize.height / cfgSize.width / 32) * 32);
+		bool exists = false;
+		for (int resolution = 0; resolution < getNumResolutions(); resolution++)
+			exists = exists || getResolution(resolution) == Size2i(width, height);
+		if (exists)
+			continue;
+		if (backend->addInputSize(width, height) < 0) {
+			cerr << "fail to add resolution " << width << "x" << height << endl;
+			return -1;
+		}
+	}
+
+	resolutionsBySize.clear();
+	for (int resolution = 0; resolution < getNumResolutions(); resolution++)
+		resolutionsBySize.push_back(resolution);
+	sort(resolutionsBySize.begin(), resolutionsBySize.end(), [this](int a, int b) {
+		return getResolution(a).area() < getResolution(b).area();
+	});
+	resolutionLatencies.assign(getNumResolutions(), 0);
+	return 0;
+}
+
+int WinDetector::detectBatch(const vector<Mat>& imgs, vector<WindowStructure>& winStructs, float thresh, bool useMean) {
+	winStructs.clear();
+	winStructs.resize(imgs.size());
+
+	vector<vector<bbox_t>> bboxesList;
+	{
+		lock_guard<mutex> lock(networkMutex);
+		backend->detectBatch(imgs, bboxesList, thresh, useMean);
+	}
+
+	int ret = 0;
+	for (size_t i = 0; i < imgs.size(); i++) {
+		if (imgs[i].data == NULL) {
+			cerr << "img " << i << " of batch is empty" << endl;
+			ret = -1;
+			continue;
+		}
+		DetectionResult result;
+		if (detectFromMarkerBoxes(imgs[i], bboxesList[i], result) < 0)
+			ret = -1;
+		winStructs[i] = move(result.winStruct);
+	}
+	return ret;
+}
+
+int WinDetector::detectFromMarkerBoxes(const Mat& img, const vector<bbox_t>& bboxes, DetectionResult& result,
+	bool showMarker, const string& imgFileName) const {
+	return detectFromMarkerBoxes(img, bboxes, img.size(), result, showMarker, imgFileName);
+}
+
+int WinDetector::detectFromMarkerBoxes(const Mat& img, const vector<bbox_t>& bboxes, Size2i outputSize, DetectionResult& result,
+	bool showMarker, const string& imgFileName) const {
+	result.imageSize = img.size();
+	vector<MarkerI>& markers = result.markers;
+	WindowStructure& winStruct = result.winStruct;
+	markers.clear();
 	for (bbox_t bbox : bboxes) {
 		MarkerI marker;
 		marker.id = bbox.obj_id;
@@ -24,12 +501,6 @@ int WinDetector::detect(const string& imgFileName, WindowStructure& winStruct, b
 	
 	string imgFileNameWOExt = imgFileName.substr(0, imgFileName.rfind('.'));
 	string imgFileExt = imgFileName.substr(imgFileName.rfind('.') + 1, string::npos);
-	
-	Mat img = imread(imgFileName);
-	if (img.data == NULL) {
-		cerr << "img file " << imgFileName << " load fail" << endl;
-		showMarker = false;
-	}
 
 	if (showMarker) {
 		Mat tmp = img.clone();
@@ -59,72 +530,109 @@ int WinDetector::detect(const string& imgFileName, WindowStructure& winStruct, b
 		imwrite(imgFileNameWOExt + "_noRedundantMarker." + imgFileExt, tmp);
 	}
 
-	// gruop markers of same surface
-	map<_Surface*, vector<MarkerI>*> xformableGroup;
-	for (MarkerI marker : markers) {
-		if (xformableGroup.find(markerIndexToSurfaceAddr[marker.id]) == xformableGroup.end()) {
-			vector<MarkerI>* vec = new vector<MarkerI>(1, marker);
-			xformableGroup.insert(pair<_Surface*, vector<MarkerI>*>(markerIndexToSurfaceAddr[marker.id], vec));
-		}
-		else 
-			xformableGroup.find(markerIndexToSurfaceAddr[marker.id])->second->push_back(marker);		
+	// group markers of same surface into per-surface buckets which are reused by later calls on this thread.
+	// buckets are shared by every WinDetector on the thread, so they are cleared when a call starts rather than when
+	// it ends, which an exception may skip
+	thread_local vector<vector<MarkerD>> surfaceMarkers;
+	thread_local vector<int> touchedSurfaces;
+	for (int surface : touchedSurfaces)
+		surfaceMarkers[surface].clear();
+	touchedSurfaces.clear();
+	if (surfaceMarkers.size() < surfaces.size())
+		surfaceMarkers.resize(surfaces.size());
+	for (const MarkerI& marker : markers) {
+		if (marker.id < 0 || marker.id >= (int)markerIndexToSurface.size() || markerIndexToSurface[marker.id] < 0)
+			continue;
+		int surface = markerIndexToSurface[marker.id];
+		if (surfaceMarkers[surface].empty())
+			touchedSurfaces.push_back(surface);
+		surfaceMarkers[surface].push_back(MarkerD(marker.id, marker.prob,
+			Point2d((double)marker.location.x / img.size().width, (double)marker.location.y / img.size().height)));
 	}
 
-	// remove if num of markers of a surface is less than 4	
-	vector<_Surface*> willRemoveKeys;
-	for (auto group : xformableGroup) {
-		if (group.second->size() < 4) {
-			delete group.second;
-			willRemoveKeys.push_back(group.first);
-		}
-	}
-	for (auto key : willRemoveKeys)
-		xformableGroup.erase(key);
-	
-	for (auto group : xformableGroup) {
-		vector<MarkerD> refRelMarkers;
-		vector<MarkerI> refAbMarkers;
-		readMarkers(buildingInfoDir + "/" + spaceToUnderBar(group.first->name) + ".markers", refRelMarkers);
-		for (MarkerD relMarker : refRelMarkers) {
-			MarkerI abMarker;
-			markerRelToAbsol(relMarker, abMarker, img.size().width, img.size().height);
-			refAbMarkers.push_back(abMarker);
-		}
+	// markers are found at the scale of img, windows are projected at outputSize
+	result.scaleTo(outputSize);
+
+	// reference geometry is kept in relative coordinates, so homography is found between relative coordinates
+	// and composed with the scale of output image
+	Mat scaleMat = (Mat_<double>(3, 3) << outputSize.width, 0, 0, 0, outputSize.height, 0, 0, 0, 1);
+	// other temporaries of this call are allocated from arena and given back all at once when it returns
+	ScratchArena arena;
+	for (int surface : touchedSurfaces) {
+		const vector<MarkerD>& relMarkers = surfaceMarkers[surface];
+		if (relMarkers.size() < 4) // surface which has less than 4 markers can't be transformed
+			continue;
 
 		Mat H;
-		if (getMarkerMatchHomography(refAbMarkers, *(group.second), H) < 0) {
-			cerr << "fail to get Homography of Surface " << group.first->name << endl;
+		if (getMarkerMatchHomography(surfaces[surface].refMarkers, relMarkers, H, &arena) < 0) {
+			cerr << "fail to get Homography of Surface " << surfaces[surface].name << endl;
 			continue;
 		}
 
-		WindowStructure ws;
-		readWindows(buildingInfoDir + "/" + spaceToUnderBar(group.first->name) + ".windows", ws, img.size().width, img.size().height);
-		ws.perspectiveXform(H);
-		winStruct += ws;
+		winStruct.pushXformedWindows(surfaces[surface].refWindowIds, surfaces[surface].refWindowVertices, scaleMat * H);
 	}
 
-	lastDetectedImageSize = img.size();
-
 	return 0;
 }
 
 
-void WinDetector::clearBuildingsInfo() {
-	for (_Building* pBuilding : pBuildings) {
-		for (_Surface* pSurface : pBuilding->pSurfaces) {
-			pSurface->markers.clear();
-			delete pSurface;
+WinDetector::WinDetector(const std::string& cfgFileName, const std::string& weightFileName, const std::string& markerNamesFileName,
+	const std::string& windowNamesFileName, const std::string& buildingInfoFileName, int gpuId) :
+	success(false), backendName("darknet") {
+	if (setMarkerNamesFormFile(markerNamesFileName) < 0)
+		return;
+	if (setWindowNamesFromFile(windowNamesFileName) < 0)
+		return;
+	if (setBuildingInfoFromFile(buildingInfoFileName) < 0)
+		return;
+	backend = createInferenceBackend(backendName, cfgFileName, weightFileName, gpuId);
+	success = backend != nullptr && setResolutions() == 0;
+}
+
+WinDetector::WinDetector(const std::string& dataFileName, const std::string& cfgFileName, const std::string& weightFileName,
+	int gpuId, const std::string& backendOverride) : success(false), backendName("darknet") {
+	if (setByDataFile(dataFileName) < 0)
+		return;
+	if (!backendOverride.empty())
+		backendName = backendOverride;
+	backend = createInferenceBackend(backendName, cfgFileName, weightFileName, gpuId);
+	if (!backend || setResolutions() < 0)
+		return;
+	if (!cascadeCfgFileName.empty() || !cascadeWeightFileName.empty()) {
+		if (cascadeCfgFileName.empty() || cascadeWeightFileName.empty()) {
+			cerr << "both cascadeCfg and cascadeWeights shall be set for cascade" << endl;
+			return;
 		}
-		pBuilding->pSurfaces.clear();
-		delete pBuilding;
+		cascadeBackend = createInferenceBackend(backendName, cascadeCfgFileName, cascadeWeightFileName, gpuId);
+		if (!cascadeBackend)
+			return;
 	}
-	markerIndexToSurfaceAddr.clear();
+	success = true;
+}
+
+WinDetector::~WinDetector() {
+	asyncJobs.close();
+	for (thread& worker : asyncWorkers)
+		if (worker.joinable())
+			worker.join();
+	asyncWorkers.clear();
+	clearBuildingsInfo();
+}
+
+void WinDetector::clearBuildingsInfo() {
+	buildingNames.clear();
+	buildingSurfaceBegins.clear();
+	surfaces.clear();
+	surfaceMarkerBegins.clear();
+	surfaceMarkerIndices.clear();
+	markerIndexToSurface.clear();
 }
 
 int WinDetector::setBuildingInfoFromFile(const std::string& filename) {
 	clearBuildingsInfo();
-	pBuildings.clear();
-	markerIndexToSurfaceAddr.clear();
+
+	size_t dirEnd = filename.find_last_of("/\\");
+	buildingInfoDir = dirEnd == string::npos ? "." : filename.substr(0, dirEnd);
 
 	int maxIndex = 0;
 	int numSurface;
@@ -135,6 +643,8 @@ int WinDetector::setBuildingInfoFromFile(const std::string& filename) {
 	}
 
 	// assign buildings
+	buildingSurfaceBegins.push_back(0);
+	surfaceMarkerBegins.push_back(0);
 	for (string line; getline(fs, line);) {
 		stringstream ss(line);
 		string buildingName;
@@ -143,8 +653,7 @@ int WinDetector::setBuildingInfoFromFile(const std::string& filename) {
 		ss >> ws;
 		getline(ss, buildingName);
 
-		pBuildings.push_back(new _Building(buildingName));
-		_Building* pLastPutBuilding = pBuildings.back();
+		buildingNames.push_back(buildingName);
 		for (int i = 0; i < numSurface; i++) {
 			string surfaceName;
 			int numIndices;
@@ -154,28 +663,49 @@ int WinDetector::setBuildingInfoFromFile(const std::string& filename) {
 			ss >> numIndices;
 			ss >> ws;
 			getline(ss, surfaceName);
-			pLastPutBuilding->pSurfaces.push_back(new _Surface(surfaceName, pLastPutBuilding));
+			surfaces.push_back(SurfaceInfo(surfaceName, (int)buildingNames.size() - 1));
 
 			string indices;
 			getline(fs, indices);
 			stringstream istream(indices);
-			_Surface* pLastPutSurface = pLastPutBuilding->pSurfaces.back();
 			for (int i = 0; i < numIndices; i++) {
 				int index;
 				istream >> index;
 				if (maxIndex < index)
 					maxIndex = index;
-				pLastPutSurface->markers.push_back(_Marker(index, pLastPutSurface));
+				surfaceMarkerIndices.push_back(index);
 			}
+			surfaceMarkerBegins.push_back((int)surfaceMarkerIndices.size());
 		}
+		buildingSurfaceBegins.push_back((int)surfaces.size());
 	}
 
-	// assign markerIndexToSurfaceAddr
-	markerIndexToSurfaceAddr.resize(maxIndex + 1);
-	for (_Building* pBuilding : pBuildings)
-		for (_Surface* pSurface : pBuilding->pSurfaces)
-			for (_Marker marker : pSurface->markers)
-				markerIndexToSurfaceAddr[marker.index] = marker.pSurface;
+	// assign markerIndexToSurface
+	markerIndexToSurface.assign((size_t)maxIndex + 1, -1);
+	for (int surface = 0; surface < (int)surfaces.size(); surface++)
+		for (int i = surfaceMarkerBegins[surface]; i < surfaceMarkerBegins[(size_t)surface + 1]; i++)
+			markerIndexToSurface[surfaceMarkerIndices[i]] = surface;
+
+	// load reference markers and windows of each surface
+	for (SurfaceInfo& surface : surfaces) {
+		string fileNameWOExt = buildingInfoDir + "/" + spaceToUnderBar(surface.name);
+		if (readMarkers(fileNameWOExt + ".markers", surface.refMarkers) < 0) {
+			cerr << "fail to load file " << fileNameWOExt + ".markers" << endl;
+			return -1;
+		}
+		sort(surface.refMarkers.begin(), surface.refMarkers.end());
+
+		vector<WindowD> refWindows;
+		if (readWindows(fileNameWOExt + ".windows", refWindows) < 0) {
+			cerr << "fail to load file " << fileNameWOExt + ".windows" << endl;
+			return -1;
+		}
+		for (const WindowD& window : refWindows) {
+			surface.refWindowIds.push_back(window.id);
+			for (int i = 0; i < 4; i++)
+				surface.refWindowVertices.push_back(Point2f((float)window.vertices[i].x, (float)window.vertices[i].y));
+		}
+	}
 
 	return 0;
 }
@@ -216,6 +746,18 @@ int WinDetector::parseDataFile(const std::string& filename) {
 			windowNamesFileName = value;
 		else if (key.compare("markerNames") == 0)
 			markerNamesFileName = value;
+		else if (key.compare("backend") == 0)
+			backendName = value;
+		else if (key.compare("cascadeCfg") == 0)
+			cascadeCfgFileName = value;
+		else if (key.compare("cascadeWeights") == 0)
+			cascadeWeightFileName = value;
+		else if (key.compare("resolutions") == 0) {
+			resolutionWidths.clear();
+			stringstream values(value);
+			for (string width; getline(values, width, ',');)
+				resolutionWidths.push_back(stoi(width));
+		}
 		else if (key.compare("buildingInfoDir") == 0) {
 			buildingInfoDir = value;
 			if (buildingInfoDir.back() == '/')
@@ -230,12 +772,12 @@ int WinDetector::parseDataFile(const std::string& filename) {
 }
 
 void WinDetector::printBuildings() {
-	for (_Building* pBuilding : pBuildings) {
-		cout << pBuilding->name << endl;
-		for (_Surface* pSurface : pBuilding->pSurfaces) {
-			cout << pSurface->name << " ";
-			for (_Marker marker : pSurface->markers)
-				cout << marker.index << " ";
+	for (size_t building = 0; building < buildingNames.size(); building++) {
+		cout << buildingNames[building] << endl;
+		for (int surface = buildingSurfaceBegins[building]; surface < buildingSurfaceBegins[building + 1]; surface++) {
+			cout << surfaces[surface].name << " ";
+			for (int i = surfaceMarkerBegins[surface]; i < surfaceMarkerBegins[(size_t)surface + 1]; i++)
+				cout << surfaceMarkerIndices[i] << " ";
 			cout << endl;
 		}
 	}
@@ -262,6 +804,91 @@ int WinDetector::setMarkerNamesFormFile(const std::string& filename) {
 	return 0;
 }
 
+DetectorPool::DetectorPool(const string& dataFileName, const string& cfgFileName, const string& weightFileName,
+	int numInstances, int gpuId) :
+	winDetector(dataFileName, cfgFileName, weightFileName, gpuId), jobs((size_t)max(numInstances, 1) * 2),
+	busyMicroseconds(new atomic<long long>[max(numInstances, 1)]), numDetected(new atomic<long long>[max(numInstances, 1)]) {
+	if (numInstances <= 0) {
+		cerr << "number of instances shall be positive" << endl;
+		return;
+	}
+	if (!winDetector)
+		return;
+	for (int i = 1; i < numInstances; i++) {
+		extraBackends.push_back(createInferenceBackend(winDetector.getBackendName(), cfgFileName, weightFileName, gpuId));
+		if (!extraBackends.back()) {
+			extraBackends.clear();
+			return;
+		}
+	}
+
+	startTime = chrono::steady_clock::now();
+	for (int i = 0; i < numInstances; i++) {
+		busyMicroseconds[i] = 0;
+		numDetected[i] = 0;
+		workers.push_back(thread(&DetectorPool::work, this, i));
+	}
+}
+
+DetectorPool::~DetectorPool() {
+	jobs.close();
+	for (thread& worker : workers)
+		worker.join();
+}
+
+void DetectorPool::work(int instance) {
+	InferenceBackend& backend = instance == 0 ? *winDetector.backend : *extraBackends[(size_t)instance - 1];
+	for (Job job; jobs.pop(job);) {
+		// exception of network goes to the caller of detect instead of terminating this thread
+		try {
+			auto begin = chrono::steady_clock::now();
+			pair<int, DetectionResult> ret;
+			vector<bbox_t> bboxes = backend.detect(*job.pImg, job.thresh, job.useMean);
+			ret.first = winDetector.detectFromMarkerBoxes(*job.pImg, bboxes, ret.second);
+			auto end = chrono::steady_clock::now();
+
+			busyMicroseconds[instance] += chrono::duration_cast<chrono::microseconds>(end - begin).count();
+			numDetected[instance]++;
+			job.promise.set_value(move(ret));
+		}
+		catch (...) {
+			job.promise.set_exception(current_exception());
+		}
+	}
+}
+
+int DetectorPool::detect(const Mat& img, DetectionResult& result, float thresh, bool useMean) {
+	if (img.data == NULL) {
+		cerr << "img is empty" << endl;
+		return -1;
+	}
+	if (workers.empty()) {
+		cerr << "detector pool has no instance" << endl;
+		return -1;
+	}
+	Job job;
+	job.pImg = &img;
+	job.thresh = thresh;
+	job.useMean = useMean;
+	future<pair<int, DetectionResult>> done = job.promise.get_future();
+	if (!jobs.push(move(job)))
+		return -1;
+
+	pair<int, DetectionResult> ret = done.get();
+	result = move(ret.second);
+	return ret.first;
+}
+
+double DetectorPool::getUtilization(int instance) const {
+	long long elapsed = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - startTime).count();
+	return elapsed == 0 ? 0 : (double)busyMicroseconds[instance] / elapsed;
+}
+
+void DetectorPool::printUtilization() const {
+	for (int i = 0; i < getNumInstances(); i++)
+		cout << "instance " << i << ": " << numDetected[i] << " images, utilization " << getUtilization(i) * 100 << "%" << endl;
+}
+
 void alignImages(Mat& im1, Mat& im2, Mat& im1Reg, Mat& h, int maxFeatures, float goodMatchPercent) {
 	// Convert images to grayscale
 	Mat im1Gray, im2Gray;
@@ -314,20 +941,19 @@ void alignImages(Mat& im1, Mat& im2, Mat& im1Reg, Mat& h, int maxFeatures, float
 }
 
 void setWindowStructure(const std::vector<bbox_t>& bboxes, WindowStructure& winStruct) {
-	winStruct.ids.clear();
-	winStruct.vertices.clear();
+	winStruct.clear();
 
 	for (bbox_t bbox : bboxes) {
-		WindowI window;
+		Window<float> window;
 		window.id = bbox.obj_id;
-		window.vertices[0].x = bbox.x;
-		window.vertices[0].y = bbox.y;
-		window.vertices[1].x = bbox.x;
-		window.vertices[1].y = bbox.y + bbox.h;
-		window.vertices[2].x = bbox.x + bbox.w;
-		window.vertices[2].y = bbox.y + bbox.h;
-		window.vertices[3].x = bbox.x + bbox.w;
-		window.vertices[3].y = bbox.y;
+		window.vertices[0].x = (float)bbox.x;
+		window.vertices[0].y = (float)bbox.y;
+		window.vertices[1].x = (float)bbox.x;
+		window.vertices[1].y = (float)(bbox.y + bbox.h);
+		window.vertices[2].x = (float)(bbox.x + bbox.w);
+		window.vertices[2].y = (float)(bbox.y + bbox.h);
+		window.vertices[3].x = (float)(bbox.x + bbox.w);
+		window.vertices[3].y = (float)bbox.y;
 		winStruct.pushWindow(window);
 	}
 }
\ No newline at end of file
@@ -1,52 +1,104 @@
 #ifndef __DETECTOR_HPP
 #define __DETECTOR_HPP
 
-#define OPENCV
-#include <yolo_v2_class.hpp>
+#include <mutex>
+#include <thread>
+#include <future>
+#include <atomic>
+#include <chrono>
 
 #include "gis.hpp"
-
-class _Marker;
-class _Surface;
-class _Building;
-
-class _Marker {
+#include "utility.hpp"
+#include "backend.hpp"
+
+constexpr int ASYNC_DETECT_WORKERS = 2; // one can post-process while the other runs the network
+constexpr size_t ASYNC_DETECT_QUEUE_SIZE = 16;
+// resolution chosen at run time, one step smaller than the largest per AUTO_RESOLUTION_QUEUE_STEP waiting async jobs
+constexpr int RESOLUTION_AUTO = -1;
+constexpr size_t AUTO_RESOLUTION_QUEUE_STEP = 4;
+// with cascade, markers of the tiny model count for a surface only above this probability
+constexpr float CASCADE_MIN_MARKER_PROB = 0.5f;
+constexpr double RESOLUTION_LATENCY_SMOOTHING = 0.2; // weight of newest time in moving average of latency
+// tiled detect runs network on tiles of network input size at image pixel scale, neighbor tiles overlap by TILE_OVERLAP.
+// marker up to TILE_OVERLAP is whole in some tile, larger one cut by tile edges is found as the union of its pieces
+constexpr int TILE_OVERLAP = 96;
+constexpr size_t TILED_DETECT_MAX_MEMORY = 256 * 1024 * 1024; // default cap of decoded image and tile inputs in bytes
+// reduced jpg decoding keeps at least this times of network input size
+constexpr double REDUCED_DECODE_MIN_NET_RATIO = 1.0;
+
+// a surface of building info, surfaces are referred by their index in WinDetector
+class SurfaceInfo {
 public:
-	int index;
-	_Surface* pSurface;
+	std::string name;
+	int buildingIndex;
+
+	// reference markers(sorted by id) and windows in relative coordinates, loaded once from building info directory
+	std::vector<MarkerD> refMarkers;
+	std::vector<int> refWindowIds;
+	std::vector<cv::Point2f> refWindowVertices; // 4 vertices per window
 
-	_Marker(int index, _Surface* pSurface) :index(index), pSurface(pSurface) {}
+	SurfaceInfo(const std::string& name, int buildingIndex) : name(name), buildingIndex(buildingIndex) {}
 };
 
-class _Surface {
+// result of a detect call, everything found from one image lives here instead of in WinDetector
+class DetectionResult {
 public:
-	_Surface(std::string name, _Building* pBuilding) :name(name), pBuilding(pBuilding) {}
+	WindowStructure winStruct;
+	std::vector<MarkerI> markers; // detected markers after removing redundant ones
+	cv::Size2i imageSize;
 
-	std::string name;
-	std::vector<_Marker> markers;
-	_Building* pBuilding;
+	// map markers and windows found on an image of imageSize to an image of size
+	void scaleTo(cv::Size2i size);
 };
 
-class _Building {
+// counters of cascade mode, times are in ms
+class CascadeStats {
 public:
-	_Building(std::string name) :name(name) {}
-
-	std::string name;
-	std::vector<_Surface*> pSurfaces;
+	uint64_t frames = 0; // frames the tiny model ran on
+	uint64_t hits = 0; // frames where the tiny model was enough
+	double tinyMs = 0; // total time of the tiny model
+	double fullMs = 0; // total time of the full model on misses
+
+	double getHitRate() const { return frames > 0 ? (double)hits / frames : 0; }
+	// time saved compared to running only the full model, whose time is estimated by its average on misses
+	double getSavedMs() const {
+		uint64_t misses = frames - hits;
+		return misses > 0 ? fullMs / misses * frames - (tinyMs + fullMs) : 0;
+	}
 };
 
-class WinDetector : public Detector{
+class WinDetector {
+	friend class DetectorPool;
+
 	bool success;
-	std::vector<_Building*> pBuildings;
-	std::vector<_Surface*> markerIndexToSurfaceAddr;
+	std::string backendName;
+	std::unique_ptr<InferenceBackend> backend;
+	std::vector<std::string> buildingNames;
+	std::vector<int> buildingSurfaceBegins; // surfaces of building b are surfaces[buildingSurfaceBegins[b] ~ buildingSurfaceBegins[b + 1])
+	std::vector<SurfaceInfo> surfaces;
+	std::vector<int> surfaceMarkerBegins; // markers of surface s are surfaceMarkerIndices[surfaceMarkerBegins[s] ~ surfaceMarkerBegins[s + 1])
+	std::vector<int> surfaceMarkerIndices;
+	std::vector<int> markerIndexToSurface; // -1 if the marker isn't on any surface
 	std::string markerNamesFileName;
 	std::string windowNamesFileName;
 	std::string buildingInfoDir;
+	std::mutex networkMutex; // backend can't run on several threads at once
+	std::vector<int> resolutionWidths; // network input widths from data file, height keeps aspect ratio of cfg
+	std::vector<int> resolutionsBySize; // resolutions in ascending order of input area
+	std::vector<double> resolutionLatencies; // moving average of detectBoxes time in ms, 0 if not measured yet
+	std::mutex latencyMutex;
+	std::string cascadeCfgFileName; // tiny model of cascade, cascade is off if it isn't set in data file
+	std::string cascadeWeightFileName;
+	std::unique_ptr<InferenceBackend> cascadeBackend;
+	std::mutex cascadeMutex; // guards cascadeBackend and cascadeStats
+	CascadeStats cascadeStats;
+	BoundedQueue<std::packaged_task<DetectionResult()>> asyncJobs{ ASYNC_DETECT_QUEUE_SIZE };
+	std::vector<std::thread> asyncWorkers;
+	std::once_flag asyncWorkersStarted;
 
 public:
 	std::vector<std::string> windowNames;
 	std::vector<std::string> markerNames;
-	cv::Size2i lastDetectedImageSize;
 
 private:
 	int setWindowNamesFromFile(const std::string& filename);
@@ -55,44 +107,130 @@ private:
 	int setByDataFile(const std::string& filename);
 	void clearBuildingsInfo();
 	int parseDataFile(const std::string& filename);
+	int setResolutions();
+	int resolveResolution(int resolution);
+	// whether every surface which has a marker in bboxes has 4 or more confident markers
+	bool isEnoughForSurfaces(const std::vector<bbox_t>& bboxes) const;
+	// marker boxes of tiles of detectTiled in coordinates of img
+	std::vector<bbox_t> detectTiledBoxes(const cv::Mat& img, float thresh, bool useMean, size_t maxMemory, bool batch);
+	// shared by cv::Mat and FrameBuffer overloads
+	template<class Image>
+	std::vector<bbox_t> detectBoxesOf(const Image& img, float thresh, bool useMean, int resolution);
+	template<class Image>
+	std::vector<bbox_t> detectMarkerBoxesOf(const Image& img, float thresh, bool useMean, int resolution);
 
 public:
 	WinDetector(const std::string& cfgFileName, const std::string& weightFileName, const std::string& markerNamesFileName,
-		const std::string& windowNamesFileName, const std::string& buildingInfoFileName, int gpu_id = 0) :
-		Detector(cfgFileName, weightFileName, gpu_id) {
-		if (setMarkerNamesFormFile(markerNamesFileName) < 0) {
-			success = false;
-			this->~WinDetector();
-			return;
-		}
-		if (setWindowNamesFromFile(windowNamesFileName) < 0) {
-			success = false;
-			this->~WinDetector();
-			return;
-		}
-		if (setBuildingInfoFromFile(buildingInfoFileName) < 0) {
-			success = false;
-			this->~WinDetector();
-			return;
-		}
-		success = true;
-	}
-	WinDetector(const std::string& dataFileName, const std::string& cfgFileName, const std::string& weightFileName, int gpuId = 0) :
-		Detector(cfgFileName, weightFileName, gpuId) {
-		if (setByDataFile(dataFileName) < 0) {
-			success = false;
-			this->~WinDetector();
-			return;
-		}
-		success = true;
-	}
-	~WinDetector() { clearBuildingsInfo(); }
+		const std::string& windowNamesFileName, const std::string& buildingInfoFileName, int gpu_id = 0);
+	// inference backend is chosen by "backend" key of data file, darknet if it isn't set.
+	// "resolutions" key(e.g. 320,416,608) adds network input widths which can be chosen per request.
+	// "cascadeCfg" and "cascadeWeights" keys set a tiny model with the same marker classes which runs before the full model.
+	// weights of fused darknet model are mapped, so they are shared with other WinDetectors and processes of the model.
+	// backendOverride replaces "backend" key if it isn't empty
+	WinDetector(const std::string& dataFileName, const std::string& cfgFileName, const std::string& weightFileName, int gpuId = 0,
+		const std::string& backendOverride = "");
+	~WinDetector();
 
 	operator bool() { return success; }
 
 	void printBuildings();
+	const std::string& getBackendName() const { return backendName; }
+	// resolution 0 is the input size of cfg, others are added by "resolutions" key of data file
+	int getNumResolutions() const { return backend ? backend->getNumInputSizes() : 0; }
+	cv::Size2i getResolution(int resolution) const;
+	// largest resolution whose latency fits latencyBudgetMs, the smallest one if none fits.
+	// latency of resolution which hasn't run yet is estimated from a measured one by input area
+	int selectResolution(double latencyBudgetMs);
+	// resolution for RESOLUTION_AUTO, goes down from the largest as async jobs wait
+	int selectResolutionByQueue();
+
+	bool isCascadeEnabled() const { return cascadeBackend != nullptr; }
+	CascadeStats getCascadeStats();
+	void printCascadeStats();
+
+	// marker boxes of img from inference backend
+	std::vector<bbox_t> detectBoxes(const cv::Mat& img, float thresh = 0.2, bool use_mean = false, int resolution = 0);
+	std::vector<bbox_t> detectBoxes(const FrameBuffer& frame, float thresh = 0.2, bool use_mean = false, int resolution = 0);
+	// marker boxes which windows are found from. with cascade, boxes of the tiny model if they are enough for every
+	// surface they touch, otherwise boxes of the full model
+	std::vector<bbox_t> detectMarkerBoxes(const cv::Mat& img, float thresh = 0.2, bool use_mean = false, int resolution = 0);
+	std::vector<bbox_t> detectMarkerBoxes(const FrameBuffer& frame, float thresh = 0.2, bool use_mean = false, int resolution = 0);
+	// decode image file, jpg is decoded at 1/2, 1/4 or 1/8 scale when reduced image still covers network input.
+	// fullSize is the size of the image at full resolution, return empty Mat if it fails
+	cv::Mat readImage(const std::string& image_filename, cv::Size2i& fullSize) const;
+	// image file is decoded by readImage, winStruct is in full resolution coordinates
 	int detect(const std::string& image_filename, WindowStructure& winStruct,
 		bool showMarker = false, float thresh = 0.2, bool use_mean = false);
+	// image file is decoded by readImage, result is in full resolution coordinates
+	int detect(const std::string& image_filename, DetectionResult& result, float thresh = 0.2, bool use_mean = false);
+	// detect with already decoded image, image_filename is only used to name marker images when showMarker is set
+	int detect(const cv::Mat& img, WindowStructure& winStruct, bool showMarker = false, float thresh = 0.2,
+		bool use_mean = false, const std::string& image_filename = "detected.jpg");
+	// re-entrant detect, may be called from several threads on one WinDetector
+	int detect(const cv::Mat& img, DetectionResult& result, float thresh = 0.2, bool use_mean = false, int resolution = 0);
+	// detect on external frame buffer(BGR, RGB, GRAY, NV12 or I420) without copying or converting it first,
+	// frame shall stay valid until this returns
+	int detect(const FrameBuffer& frame, DetectionResult& result, float thresh = 0.2, bool use_mean = false, int resolution = 0);
+	// detect on overlapping tiles instead of shrinking whole image, for small markers of high resolution images.
+	// image is decoded at the largest scale whose size is under half of maxMemory and tiles run in batches which fit
+	// the other half. result is in full resolution coordinates
+	int detectTiled(const std::string& image_filename, DetectionResult& result, float thresh = 0.2, bool use_mean = false,
+		size_t maxMemory = TILED_DETECT_MAX_MEMORY, bool batch = true);
+	int detectTiled(const cv::Mat& img, DetectionResult& result, float thresh = 0.2, bool use_mean = false,
+		size_t maxMemory = TILED_DETECT_MAX_MEMORY, bool batch = true);
+	// queue img to be detected on internal worker threads, future throws std::runtime_error if detection fails
+	std::future<DetectionResult> detectAsync(cv::Mat img, float thresh = 0.2, bool use_mean = false,
+		int resolution = RESOLUTION_AUTO);
+	// detect each of imgs, winStructs[i] is the result of imgs[i]
+	int detectBatch(const std::vector<cv::Mat>& imgs, std::vector<WindowStructure>& winStructs,
+		float thresh = 0.2, bool use_mean = false);
+
+	// find windows of surfaces from detected marker boxes of img, only reads building info so it's safe on any thread
+	int detectFromMarkerBoxes(const cv::Mat& img, const std::vector<bbox_t>& bboxes, DetectionResult& result,
+		bool showMarker = false, const std::string& image_filename = "detected.jpg") const;
+	// same as above for img decoded smaller than an image of outputSize, result is in coordinates of outputSize.
+	// windows are projected straight to outputSize, so they aren't quantized by the scale of img
+	int detectFromMarkerBoxes(const cv::Mat& img, const std::vector<bbox_t>& bboxes, cv::Size2i outputSize,
+		DetectionResult& result, bool showMarker = false, const std::string& image_filename = "detected.jpg") const;
+};
+
+// N inference backends built from same cfg/weights sharing building info of one WinDetector.
+// detect calls are queued and taken by whichever network is free
+class DetectorPool {
+	class Job {
+	public:
+		const cv::Mat* pImg;
+		float thresh;
+		bool useMean;
+		std::promise<std::pair<int, DetectionResult>> promise;
+	};
+
+	WinDetector winDetector; // backend of instance 0 and shared building info
+	std::vector<std::unique_ptr<InferenceBackend>> extraBackends; // backends of instance 1 ~ N-1
+	BoundedQueue<Job> jobs;
+	std::vector<std::thread> workers;
+	std::unique_ptr<std::atomic<long long>[]> busyMicroseconds;
+	std::unique_ptr<std::atomic<long long>[]> numDetected;
+	std::chrono::steady_clock::time_point startTime;
+
+	void work(int instance);
+
+public:
+	DetectorPool(const std::string& dataFileName, const std::string& cfgFileName, const std::string& weightFileName,
+		int numInstances, int gpuId = 0);
+	~DetectorPool();
+
+	operator bool() { return (bool)winDetector && !workers.empty(); }
+
+	// detect on one of instances, blocks until done. return -1 if the pool has no instance,
+	// exception thrown by the network is rethrown here
+	int detect(const cv::Mat& img, DetectionResult& result, float thresh = 0.2, bool use_mean = false);
+	int getNumInstances() const { return (int)workers.size(); }
+	// ratio of time the instance spent on detection since the pool was created
+	double getUtilization(int instance) const;
+	long long getNumDetected(int instance) const { return numDetected[instance]; }
+	void printUtilization() const;
+	const WinDetector& getWinDetector() const { return winDetector; }
 };
 
 void alignImages(cv::Mat& im1, cv::Mat& im2, cv::Mat& im1Reg, cv::Mat& h, int maxFeatures = 500, float goodMatchPercent = 0.15f);
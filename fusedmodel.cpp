@@ -0,0 +1,277 @@
+#include "fusedmodel.hpp"
+
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <map>
+#include <cmath>
+#include <cstdint>
+#include <filesystem>
+#include <algorithm>
+
+using namespace std;
+
+static string trim(const string& str) {
+	size_t begin = str.find_first_not_of(" \t\r\n");
+	if (begin == string::npos)
+		return "";
+	size_t end = str.find_last_not_of(" \t\r\n");
+	return str.substr(begin, end - begin + 1);
+}
+
+int readCfgSections(const string& cfgFileName, vector<CfgSection>& sections) {
+	ifstream ifs(cfgFileName);
+	if (!ifs.is_open()) {
+		cerr << "fail to load cfg file " << cfgFileName << endl;
+		return -1;
+	}
+	for (string line; getline(ifs, line);) {
+		line = trim(line.substr(0, line.find_first_of("#;")));
+		if (line.empty())
+			continue;
+		if (line[0] == '[') {
+			CfgSection section;
+			section.type = line.substr(1, line.find(']') - 1);
+			sections.push_back(section);
+			continue;
+		}
+		size_t equal = line.find('=');
+		if (equal == string::npos || sections.empty())
+			continue;
+		sections.back().options[trim(line.substr(0, equal))] = trim(line.substr(equal + 1));
+	}
+	return 0;
+}
+
+int CfgSection::getInt(const string& key, int defaultValue) const {
+	auto option = options.find(key);
+	return option == options.end() ? defaultValue : stoi(option->second);
+}
+
+float CfgSection::getFloat(const string& key, float defaultValue) const {
+	auto option = options.find(key);
+	return option == options.end() ? defaultValue : stof(option->second);
+}
+
+string CfgSection::getString(const string& key, const string& defaultValue) const {
+	auto option = options.find(key);
+	return option == options.end() ? defaultValue : option->second;
+}
+
+vector<float> CfgSection::getList(const string& key) const {
+	vector<float> values;
+	auto option = options.find(key);
+	if (option == options.end())
+		return values;
+	stringstream ss(option->second);
+	for (string value; getline(ss, value, ',');)
+		if (!trim(value).empty())
+			values.push_back(stof(value));
+	return values;
+}
+
+// copy cfg with batch_normalize=0 in convolutional layers
+static int writeFusedCfg(const string& cfgFileName, const string& fusedCfgFileName) {
+	ifstream ifs(cfgFileName);
+	ofstream ofs(fusedCfgFileName);
+	if (!ifs.is_open() || !ofs.is_open()) {
+		cerr << "fail to write cfg file " << fusedCfgFileName << endl;
+		return -1;
+	}
+	string type;
+	for (string line; getline(ifs, line);) {
+		string content = trim(line.substr(0, line.find_first_of("#;")));
+		if (content.size() > 0 && content[0] == '[')
+			type = content.substr(1, content.find(']') - 1);
+		size_t equal = content.find('=');
+		if ((type.compare("convolutional") == 0 || type.compare("conv") == 0) && equal != string::npos &&
+			trim(content.substr(0, equal)).compare("batch_normalize") == 0)
+			line = "batch_normalize=0";
+		ofs << line << "\n";
+	}
+	return ofs ? 0 : -1;
+}
+
+void getFusedModelFileNames(const string& weightFileName, string& fusedCfgFileName, string& fusedWeightFileName) {
+	string base = weightFileName.substr(0, weightFileName.rfind('.'));
+	fusedCfgFileName = base + ".fused.cfg";
+	fusedWeightFileName = base + ".fused.weights";
+}
+
+size_t getWeightsHeaderSize(const int32_t version[3]) {
+	if (version[0] * 10 + version[1] >= 2 && version[0] < 1000 && version[1] < 1000)
+		return sizeof(int32_t) * 3 + sizeof(uint64_t);
+	return sizeof(int32_t) * 3 + sizeof(uint32_t);
+}
+
+int readDarknetModel(const string& cfgFileName, const string& weightFileName, DarknetModel& model) {
+	model.sections.clear();
+	model.convs.clear();
+	if (readCfgSections(cfgFileName, model.sections) < 0)
+		return -1;
+	const vector<CfgSection>& sections = model.sections;
+	if (sections.empty() || (sections[0].type.compare("net") != 0 && sections[0].type.compare("network") != 0)) {
+		cerr << "cfg file " << cfgFileName << " doesn't start with [net]" << endl;
+		return -1;
+	}
+
+	ifstream ifs(weightFileName, ios::binary);
+	if (!ifs.is_open()) {
+		cerr << "fail to load weights file " << weightFileName << endl;
+		return -1;
+	}
+
+	// header is major, minor, revision and number of seen images whose size depends on the version
+	ifs.read((char*)model.version, sizeof(model.version));
+	model.seen = 0;
+	if (model.version[0] * 10 + model.version[1] >= 2 && model.version[0] < 1000 && model.version[1] < 1000)
+		ifs.read((char*)&model.seen, sizeof(uint64_t));
+	else {
+		uint32_t seen = 0;
+		ifs.read((char*)&seen, sizeof(uint32_t));
+		model.seen = seen;
+	}
+	if (!ifs) {
+		cerr << "wrong header of weights file " << weightFileName << endl;
+		return -1;
+	}
+
+	auto readFloats = [&ifs](vector<float>& values, size_t size) {
+		values.resize(size);
+		ifs.read((char*)values.data(), size * sizeof(float));
+	};
+
+	// output channels of each layer, input channels of convolutional layer are needed to know its weights size
+	vector<int> layerChannels;
+	int channels = sections[0].getInt("channels", 3);
+	vector<float> scales, means, variances;
+	for (size_t s = 1; s < sections.size(); s++) {
+		const CfgSection& section = sections[s];
+		const string& type = section.type;
+		int layer = (int)layerChannels.size();
+		if (type.compare("convolutional") == 0 || type.compare("conv") == 0) {
+			ConvWeights conv;
+			conv.layer = layer;
+			conv.filters = section.getInt("filters", 1);
+			conv.channels = channels;
+			conv.groups = section.getInt("groups", 1);
+			conv.size = section.getInt("size", 1);
+			size_t filterSize = (size_t)(channels / conv.groups) * conv.size * conv.size;
+			bool batchNormalize = section.getInt("batch_normalize", 0) != 0;
+
+			readFloats(conv.biases, conv.filters);
+			if (batchNormalize) {
+				readFloats(scales, conv.filters);
+				readFloats(means, conv.filters);
+				readFloats(variances, conv.filters);
+			}
+			readFloats(conv.weights, conv.filters * filterSize);
+			if (!ifs) {
+				cerr << "weights file " << weightFileName << " is shorter than layer " << layer << " of " << cfgFileName << endl;
+				return -1;
+			}
+
+			// same folding as fuse_conv_batchnorm of darknet
+			if (batchNormalize) {
+				for (int f = 0; f < conv.filters; f++) {
+					double scale = scales[f] / sqrt((double)variances[f] + .00001);
+					conv.biases[f] = (float)(conv.biases[f] - means[f] * scale);
+					for (size_t i = f * filterSize; i < (f + 1) * filterSize; i++)
+						conv.weights[i] = (float)(conv.weights[i] * scale);
+				}
+			}
+			channels = conv.filters;
+			model.convs.push_back(move(conv));
+		}
+		else if (type.compare("route") == 0) {
+			auto layers = section.options.find("layers");
+			if (layers == section.options.end()) {
+				cerr << "route layer " << layer << " has no layers" << endl;
+				return -1;
+			}
+			channels = 0;
+			stringstream ss(layers->second);
+			for (string index; getline(ss, index, ',');) {
+				int src = stoi(index);
+				if (src < 0)
+					src += layer;
+				if (src < 0 || src >= layer) {
+					cerr << "route layer " << layer << " refers wrong layer " << index << endl;
+					return -1;
+				}
+				channels += layerChannels[src];
+			}
+			channels /= section.getInt("groups", 1);
+		}
+		else if (type.compare("reorg") == 0) {
+			int stride = section.getInt("stride", 1);
+			channels *= stride * stride;
+		}
+		else if (type.compare("shortcut") != 0 && type.compare("upsample") != 0 && type.compare("yolo") != 0 &&
+			type.compare("region") != 0 && type.compare("maxpool") != 0 && type.compare("avgpool") != 0 &&
+			type.compare("dropout") != 0 && type.compare("softmax") != 0 && type.compare("cost") != 0) {
+			cerr << "layer " << type << " isn't supported" << endl;
+			return -1;
+		}
+		layerChannels.push_back(channels);
+	}
+	if (ifs.peek() != EOF)
+		cerr << "weights file " << weightFileName << " has more weights than " << cfgFileName << ", they are dropped" << endl;
+	return 0;
+}
+
+static int writeFusedWeights(const string& cfgFileName, const string& weightFileName, const string& fusedWeightFileName) {
+	DarknetModel model;
+	if (readDarknetModel(cfgFileName, weightFileName, model) < 0)
+		return -1;
+
+	ofstream ofs(fusedWeightFileName, ios::binary);
+	if (!ofs.is_open()) {
+		cerr << "fail to write weights file " << fusedWeightFileName << endl;
+		return -1;
+	}
+	ofs.write((char*)model.version, sizeof(model.version));
+	if (model.version[0] * 10 + model.version[1] >= 2 && model.version[0] < 1000 && model.version[1] < 1000)
+		ofs.write((char*)&model.seen, sizeof(uint64_t));
+	else {
+		uint32_t seen = (uint32_t)model.seen;
+		ofs.write((char*)&seen, sizeof(uint32_t));
+	}
+	for (const ConvWeights& conv : model.convs) {
+		ofs.write((char*)conv.biases.data(), conv.biases.size() * sizeof(float));
+		ofs.write((char*)conv.weights.data(), conv.weights.size() * sizeof(float));
+	}
+	return ofs ? 0 : -1;
+}
+
+int compileFusedModel(const string& cfgFileName, const string& weightFileName) {
+	string fusedCfgFileName, fusedWeightFileName;
+	getFusedModelFileNames(weightFileName, fusedCfgFileName, fusedWeightFileName);
+	if (writeFusedWeights(cfgFileName, weightFileName, fusedWeightFileName) < 0 ||
+		writeFusedCfg(cfgFileName, fusedCfgFileName) < 0) {
+		cerr << "fail to compile fused model of " << weightFileName << endl;
+		filesystem::remove(fusedWeightFileName);
+		filesystem::remove(fusedCfgFileName);
+		return -1;
+	}
+	cout << "fused model is written to " << fusedCfgFileName << " and " << fusedWeightFileName << endl;
+	return 0;
+}
+
+bool useFusedModel(string& cfgFileName, string& weightFileName) {
+	string fusedCfgFileName, fusedWeightFileName;
+	getFusedModelFileNames(weightFileName, fusedCfgFileName, fusedWeightFileName);
+
+	if (!filesystem::exists(fusedCfgFileName) || !filesystem::exists(fusedWeightFileName))
+		return false;
+	auto sourceTime = max(filesystem::last_write_time(cfgFileName), filesystem::last_write_time(weightFileName));
+	if (filesystem::last_write_time(fusedCfgFileName) < sourceTime || filesystem::last_write_time(fusedWeightFileName) < sourceTime) {
+		cerr << "fused model of " << weightFileName << " is older than its source, it isn't used" << endl;
+		return false;
+	}
+
+	cfgFileName = fusedCfgFileName;
+	weightFileName = fusedWeightFileName;
+	return true;
+}
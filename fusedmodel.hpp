@@ -0,0 +1,59 @@
+#ifndef __FUSEDMODEL_HPP
+#define __FUSEDMODEL_HPP
+
+#include <string>
+#include <vector>
+#include <map>
+#include <cstdint>
+
+// a section of darknet cfg
+class CfgSection {
+public:
+	std::string type;
+	std::map<std::string, std::string> options;
+
+	int getInt(const std::string& key, int defaultValue) const;
+	float getFloat(const std::string& key, float defaultValue) const;
+	std::string getString(const std::string& key, const std::string& defaultValue) const;
+	// comma separated values, empty if key isn't set
+	std::vector<float> getList(const std::string& key) const;
+};
+
+// parameters of a convolutional layer whose batch normalization is folded in
+class ConvWeights {
+public:
+	int layer; // index of layer, [net] isn't counted
+	int filters;
+	int channels; // input channels
+	int groups;
+	int size;
+	std::vector<float> biases;
+	std::vector<float> weights; // filters x (channels / groups) x size x size
+};
+
+// darknet cfg and weights in memory
+class DarknetModel {
+public:
+	std::vector<CfgSection> sections; // sections[0] is [net]
+	std::vector<ConvWeights> convs; // in order of layers
+	int32_t version[3];
+	uint64_t seen;
+};
+
+int readCfgSections(const std::string& cfgFileName, std::vector<CfgSection>& sections);
+// bytes of weights file header of version, number of seen images is 64 bit from version 0.2
+size_t getWeightsHeaderSize(const int32_t version[3]);
+// read cfg and weights, batch normalization of convolutional layers is folded into their weights and biases
+int readDarknetModel(const std::string& cfgFileName, const std::string& weightFileName, DarknetModel& model);
+
+// cfg and weights of fused model compiled from weightFileName, written next to it
+void getFusedModelFileNames(const std::string& weightFileName, std::string& fusedCfgFileName, std::string& fusedWeightFileName);
+// fold batch normalization of convolutional layers into their weights and biases, and write the result as
+// cfg(batch_normalize=0) and weights which darknet and OpenCV dnn load without fusing again.
+// weights are biases and weights of each convolutional layer in a row, so darknet backend maps the file and points
+// its layers at it instead of reading it
+int compileFusedModel(const std::string& cfgFileName, const std::string& weightFileName);
+// replace cfgFileName and weightFileName with fused model if it exists and is newer than them, return if replaced
+bool useFusedModel(std::string& cfgFileName, std::string& weightFileName);
+
+#endif
@@ -8,6 +8,13 @@
 #include <algorithm>
 #include <functional>
 #include <cmath>
+#include <climits>
+#include <cfloat>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define GIS_SSE2
+#endif
 
 using namespace std;
 using namespace cv;
@@ -86,10 +93,10 @@ double getIOU(const std::vector<cv::Point2i>& vertices1, const std::vector<cv::P
 }
 
 double getIOU(const WindowI& window1, const WindowI& window2) {
-	std::vector<cv::Point2i> vertices1, vertices2;
-	vertices1 = window1.getVertices();
-	vertices2 = window2.getVertices();
-	return getIOU(vertices1, vertices2);
+	int area1 = getDoubledArea(window1);
+	int area2 = getDoubledArea(window2);
+	double intersection = getDoubledIntersectedArea(window1.vertices, window2.vertices);
+	return intersection / (area1 + area2 - intersection);
 }
 
 double getIOU(std::vector<WindowI>& windows, std::vector<WindowI>& groundTruth) {
@@ -140,12 +147,229 @@ double getIOU(std::vector<WindowI>& windows, std::vector<WindowI>& groundTruth)
 	return addCount == 0 ? 0 : totalIOU / addCount;
 }
 
-double getIOU(WindowStructure& winStruct, WindowStructure& groundTruth) {
-	std::vector<WindowI> windows1, windows2;
-	winStruct.getWindows(windows1);
-	groundTruth.getWindows(windows2);
-	return getIOU(windows1, windows2);
+template <class T>
+static double getDoubledIntersectedQuadArea(const Point_<T>* quad1, const Point_<T>* quad2);
+
+// bounding box and shape of a window for batched IOU
+class QuadInfo {
+public:
+	float minX, minY, maxX, maxY;
+	double dArea; // doubled area
+	int orientation; // sign of signed area
+	bool convex; // convex and not degenerated
+};
+
+template <class T>
+static inline void getQuad(const WindowStructureT<T>& winStruct, size_t index, Point_<T> quad[4]) {
+	for (int k = 0; k < 4; k++)
+		quad[k] = winStruct.getVertex(index * 4 + k);
+}
+
+template <class T>
+static void getQuadInfos(const WindowStructureT<T>& winStruct, vector<QuadInfo>& infos) {
+	infos.resize(winStruct.size());
+	for (size_t i = 0; i < infos.size(); i++) {
+		Point_<T> v[4];
+		getQuad(winStruct, i, v);
+		QuadInfo& info = infos[i];
+		info.minX = (float)min(min(v[0].x, v[1].x), min(v[2].x, v[3].x));
+		info.maxX = (float)max(max(v[0].x, v[1].x), max(v[2].x, v[3].x));
+		info.minY = (float)min(min(v[0].y, v[1].y), min(v[2].y, v[3].y));
+		info.maxY = (float)max(max(v[0].y, v[1].y), max(v[2].y, v[3].y));
+		double signedArea = ((double)v[0].x - v[2].x) * ((double)v[1].y - v[3].y) - ((double)v[1].x - v[3].x) * ((double)v[0].y - v[2].y);
+		info.dArea = fabs(signedArea);
+		info.orientation = signedArea > 0 ? 1 : -1;
+		info.convex = signedArea != 0;
+		for (int k = 0; k < 4 && info.convex; k++) {
+			Point2d e1 = Point2d(v[(k + 1) & 3]) - Point2d(v[k]), e2 = Point2d(v[(k + 2) & 3]) - Point2d(v[(k + 1) & 3]);
+			info.convex = (e1.x * e2.y - e1.y * e2.x) * info.orientation >= 0;
+		}
+	}
+}
+
+#ifdef GIS_SSE2
+// doubled signed area swept by the parts of edges of polygon p inside convex polygon q, 4 pairs in lanes.
+// each edge is clipped parametrically by the half planes of q(Cyrus-Beck), which needs no branch.
+// an edge lying on an edge of q counts only if sameDirection lanes have the edges in same direction and
+// both polygons on the same side, so a shared boundary is counted once and a touching one never
+static __m128 getClippedEdgeSum(const __m128 px[4], const __m128 py[4], const __m128 qx[4], const __m128 qy[4],
+	__m128 qOrientation, __m128 sameDirection, bool countShared) {
+	const __m128 zero = _mm_setzero_ps();
+	__m128 sum = zero;
+	for (int i = 0; i < 4; i++) {
+		__m128 p0x = px[i], p0y = py[i];
+		__m128 dx = _mm_sub_ps(px[(i + 1) & 3], p0x), dy = _mm_sub_ps(py[(i + 1) & 3], p0y);
+		__m128 tLow = zero, tHigh = _mm_set1_ps(1), empty = zero;
+		for (int j = 0; j < 4; j++) {
+			__m128 ax = qx[j], ay = qy[j];
+			__m128 ex = _mm_sub_ps(qx[(j + 1) & 3], ax), ey = _mm_sub_ps(qy[(j + 1) & 3], ay);
+			// sides of edge ends against edge of q, positive inside
+			__m128 s0 = _mm_mul_ps(qOrientation, _mm_sub_ps(_mm_mul_ps(ex, _mm_sub_ps(p0y, ay)), _mm_mul_ps(ey, _mm_sub_ps(p0x, ax))));
+			__m128 d = _mm_mul_ps(qOrientation, _mm_sub_ps(_mm_mul_ps(ex, dy), _mm_mul_ps(ey, dx)));
+			__m128 t = _mm_div_ps(s0, _mm_sub_ps(zero, d));
+			__m128 entering = _mm_cmpgt_ps(d, zero), leaving = _mm_cmplt_ps(d, zero);
+			tLow = _mm_or_ps(_mm_and_ps(entering, _mm_max_ps(tLow, t)), _mm_andnot_ps(entering, tLow));
+			tHigh = _mm_or_ps(_mm_and_ps(leaving, _mm_min_ps(tHigh, t)), _mm_andnot_ps(leaving, tHigh));
+			// parallel edge is outside, or on the edge of q but not shared
+			__m128 parallel = _mm_cmpeq_ps(d, zero);
+			__m128 outside = _mm_cmplt_ps(s0, zero);
+			__m128 onEdge = _mm_cmpeq_ps(s0, zero);
+			if (countShared) {
+				__m128 dot = _mm_add_ps(_mm_mul_ps(dx, ex), _mm_mul_ps(dy, ey));
+				onEdge = _mm_and_ps(onEdge, _mm_cmple_ps(_mm_mul_ps(dot, sameDirection), zero));
+			}
+			empty = _mm_or_ps(empty, _mm_and_ps(parallel, _mm_or_ps(outside, onEdge)));
+		}
+		__m128 valid = _mm_andnot_ps(empty, _mm_cmpgt_ps(tHigh, tLow));
+		__m128 q0x = _mm_add_ps(p0x, _mm_mul_ps(tLow, dx)), q0y = _mm_add_ps(p0y, _mm_mul_ps(tLow, dy));
+		__m128 q1x = _mm_add_ps(p0x, _mm_mul_ps(tHigh, dx)), q1y = _mm_add_ps(p0y, _mm_mul_ps(tHigh, dy));
+		__m128 cross = _mm_sub_ps(_mm_mul_ps(q0x, q1y), _mm_mul_ps(q0y, q1x));
+		sum = _mm_add_ps(sum, _mm_and_ps(valid, cross));
+	}
+	return sum;
 }
+#endif
+
+// IOU of pairs(index in winStruct1, index in winStruct2). pairs of convex windows are intersected 4 at once,
+// by Green's theorem over the parts of both boundaries inside the other window
+template <class T>
+static void getIOUs(const WindowStructureT<T>& winStruct1, const vector<QuadInfo>& infos1, const WindowStructureT<T>& winStruct2,
+	const vector<QuadInfo>& infos2, const vector<pair<int, int>>& pairs, float* ious) {
+	vector<int> batch;
+	batch.reserve(pairs.size());
+	for (size_t n = 0; n < pairs.size(); n++) {
+		const QuadInfo& info1 = infos1[pairs[n].first];
+		const QuadInfo& info2 = infos2[pairs[n].second];
+#ifdef GIS_SSE2
+		if (info1.convex && info2.convex) {
+			batch.push_back((int)n);
+			continue;
+		}
+#endif
+		Point_<T> quad1[4], quad2[4];
+		getQuad(winStruct1, pairs[n].first, quad1);
+		getQuad(winStruct2, pairs[n].second, quad2);
+		double intersection = getDoubledIntersectedQuadArea(quad1, quad2);
+		ious[n] = (float)(intersection / (info1.dArea + info2.dArea - intersection));
+	}
+
+#ifdef GIS_SSE2
+	for (size_t b = 0; b < batch.size(); b += 4) {
+		// vertex k of lane l at [k][l], relative to vertex 0 of first window to keep products exact in float
+		alignas(16) float coords[4][4][4];
+		alignas(16) float orientations[2][4];
+		for (int l = 0; l < 4; l++) {
+			const pair<int, int>& p = pairs[batch[min(b + l, batch.size() - 1)]];
+			Point_<T> v1[4], v2[4];
+			getQuad(winStruct1, p.first, v1);
+			getQuad(winStruct2, p.second, v2);
+			for (int k = 0; k < 4; k++) {
+				coords[0][k][l] = (float)(v1[k].x - v1[0].x);
+				coords[1][k][l] = (float)(v1[k].y - v1[0].y);
+				coords[2][k][l] = (float)(v2[k].x - v1[0].x);
+				coords[3][k][l] = (float)(v2[k].y - v1[0].y);
+			}
+			orientations[0][l] = (float)infos1[p.first].orientation;
+			orientations[1][l] = (float)infos2[p.second].orientation;
+		}
+		__m128 x1[4], y1[4], x2[4], y2[4];
+		for (int k = 0; k < 4; k++) {
+			x1[k] = _mm_load_ps(coords[0][k]);
+			y1[k] = _mm_load_ps(coords[1][k]);
+			x2[k] = _mm_load_ps(coords[2][k]);
+			y2[k] = _mm_load_ps(coords[3][k]);
+		}
+		__m128 orientation1 = _mm_load_ps(orientations[0]), orientation2 = _mm_load_ps(orientations[1]);
+		__m128 sameOrientation = _mm_mul_ps(orientation1, orientation2);
+		// boundary of window2 is traversed in its own orientation, flip it if it differs from window1
+		__m128 sum = _mm_add_ps(getClippedEdgeSum(x1, y1, x2, y2, orientation2, sameOrientation, true),
+			_mm_mul_ps(sameOrientation, getClippedEdgeSum(x2, y2, x1, y1, orientation1, sameOrientation, false)));
+		alignas(16) float intersections[4];
+		_mm_store_ps(intersections, sum);
+		for (size_t l = 0; l < 4 && b + l < batch.size(); l++) {
+			int n = batch[b + l];
+			double intersection = fabs(intersections[l]);
+			ious[n] = (float)(intersection / (infos1[pairs[n].first].dArea + infos2[pairs[n].second].dArea - intersection));
+		}
+	}
+#endif
+}
+
+template <class T>
+double getIOU(const WindowStructureT<T>& winStruct, const WindowStructureT<T>& groundTruth) {
+	if (winStruct.size() == 0)
+		return 0;
+
+	// windows in order of id, groundTruth has one window per id
+	auto sortById = [](const WindowStructureT<T>& ws) {
+		vector<int> order(ws.size());
+		for (size_t i = 0; i < order.size(); i++)
+			order[i] = (int)i;
+		stable_sort(order.begin(), order.end(), [&ws](int i1, int i2) { return ws.ids[i1] < ws.ids[i2]; });
+		return order;
+	};
+	vector<int> order = sortById(winStruct), gtOrder = sortById(groundTruth);
+	Mat ious = computeIoUMatrix(winStruct, groundTruth);
+
+	// duplicated windows of an id keep the best one. as getIOU of vector<WindowI>, windows whose id isn't in
+	// groundTruth are counted only after the last id of groundTruth
+	double totalIOU = 0;
+	int addCount = 0;
+	for (size_t i = 0, j = 0; i < order.size() || j < gtOrder.size();) {
+		int id = i < order.size() ? winStruct.ids[order[i]] : INT_MAX;
+		int gtId = j < gtOrder.size() ? groundTruth.ids[gtOrder[j]] : INT_MAX;
+		if (id == gtId) {
+			float best = ious.at<float>(order[i], gtOrder[j]);
+			for (i++; i < order.size() && winStruct.ids[order[i]] == id; i++)
+				if (best < ious.at<float>(order[i], gtOrder[j]))
+					best = ious.at<float>(order[i], gtOrder[j]);
+			totalIOU += best;
+			addCount++;
+			j++;
+		}
+		else if (id < gtId) {
+			while (++i < order.size() && winStruct.ids[order[i]] == id)
+				;
+			if (j == gtOrder.size())
+				addCount++;
+		}
+		else {
+			addCount++;
+			j++;
+		}
+	}
+	return addCount == 0 ? 0 : totalIOU / addCount;
+}
+
+template double getIOU(const WindowStructureI& winStruct, const WindowStructureI& groundTruth);
+template double getIOU(const WindowStructureF& winStruct, const WindowStructureF& groundTruth);
+
+template <class T>
+Mat computeIoUMatrix(const WindowStructureT<T>& pred, const WindowStructureT<T>& gt) {
+	Mat ious = Mat::zeros((int)pred.size(), (int)gt.size(), CV_32F);
+	vector<QuadInfo> predInfos, gtInfos;
+	getQuadInfos(pred, predInfos);
+	getQuadInfos(gt, gtInfos);
+
+	// windows whose bounding boxes don't overlap stay 0
+	vector<pair<int, int>> pairs;
+	for (int i = 0; i < (int)predInfos.size(); i++) {
+		const QuadInfo& p = predInfos[i];
+		for (int j = 0; j < (int)gtInfos.size(); j++) {
+			const QuadInfo& g = gtInfos[j];
+			if (p.minX < g.maxX && g.minX < p.maxX && p.minY < g.maxY && g.minY < p.maxY)
+				pairs.push_back(make_pair(i, j));
+		}
+	}
+	vector<float> values(pairs.size());
+	getIOUs(pred, predInfos, gt, gtInfos, pairs, values.data());
+	for (size_t n = 0; n < pairs.size(); n++)
+		ious.at<float>(pairs[n].first, pairs[n].second) = values[n];
+	return ious;
+}
+
+template Mat computeIoUMatrix(const WindowStructureI& pred, const WindowStructureI& gt);
+template Mat computeIoUMatrix(const WindowStructureF& pred, const WindowStructureF& gt);
 
 void markerRelToAbsol(const MarkerD& relMarker, MarkerI& absolMarker, int width, int height) {
 	absolMarker.id = relMarker.id;
@@ -198,123 +422,286 @@ int readWindows(const std::string& fileName, vector<Window<double>*>& windows) {
 	return 0;
 }
 
-int readWindows(const std::string& fileName, WindowStructure& windowStruct, int width, int height) {
-	vector<Window<double>*> windows;
-	int ret = readWindows(fileName, windows);
-	if (ret < 0)
-		return ret;
-	windowStruct.set(windows, width, height);
+int readWindows(const std::string& fileName, vector<Window<double>>& windows) {
+	ifstream ifs(fileName);
+	if (!ifs.is_open())
+		return -1;
+	for (string line; getline(ifs, line);) {
+		stringstream ss(line);
+		Window<double> window;
+		ss >> window.id;
+		ss >> window.vertices[0].x;
+		ss >> window.vertices[0].y;
+		ss >> window.vertices[1].x;
+		ss >> window.vertices[1].y;
+		ss >> window.vertices[2].x;
+		ss >> window.vertices[2].y;
+		ss >> window.vertices[3].x;
+		ss >> window.vertices[3].y;
+		windows.push_back(window);
+	}
 	return 0;
 }
 
-void WindowStructure::set(const vector<Window<double>*>& windows, int width, int height) {
-	this->ids.clear();
-	this->vertices.clear();
-
-	for (Window<double>* pWindow : windows) {
-		Window<int> windowI;
-		windowI.id = pWindow->id;
+template <class T>
+int readWindows(const std::string& fileName, WindowStructureT<T>& windowStruct, int width, int height) {
+	ifstream ifs(fileName);
+	if (!ifs.is_open())
+		return -1;
+	windowStruct.clear();
+	for (string line; getline(ifs, line);) {
+		stringstream ss(line);
+		int id = 0;
+		ss >> id;
+		windowStruct.ids.push_back(id);
 		for (int i = 0; i < 4; i++) {
-			windowI.vertices[i].x = (int)(pWindow->vertices[i].x * width);
-			windowI.vertices[i].y = (int)(pWindow->vertices[i].y * height);
+			double x = 0, y = 0;
+			ss >> x >> y;
+			windowStruct.xs.push_back((T)(x * width));
+			windowStruct.ys.push_back((T)(y * height));
 		}
-		pushWindow(windowI);
 	}
+	return 0;
 }
 
-void WindowStructure::set(const vector<Window<double>>& windows, int width, int height) {
-	this->ids.clear();
-	this->vertices.clear();
+template int readWindows(const std::string& fileName, WindowStructureI& windowStruct, int width, int height);
+template int readWindows(const std::string& fileName, WindowStructureF& windowStruct, int width, int height);
 
-	for (Window<double> window : windows) {
-		Window<int> windowI;
-		windowI.id = window.id;
+template <class T>
+void WindowStructureT<T>::set(const vector<Window<double>*>& windows, int width, int height) {
+	clear();
+
+	for (Window<double>* pWindow : windows) {
+		ids.push_back(pWindow->id);
 		for (int i = 0; i < 4; i++) {
-			windowI.vertices[i].x = (int)(window.vertices[i].x * width);
-			windowI.vertices[i].y = (int)(window.vertices[i].y * height);
+			xs.push_back((T)(pWindow->vertices[i].x * width));
+			ys.push_back((T)(pWindow->vertices[i].y * height));
 		}
-		pushWindow(windowI);
 	}
 }
 
-void WindowStructure::set(const vector<Window<int>>& windows) {
-	this->ids.clear();
-	this->vertices.clear();
+template <class T>
+void WindowStructureT<T>::set(const vector<Window<double>>& windows, int width, int height) {
+	clear();
 
-	for (WindowI window : windows) {
+	for (const Window<double>& window : windows) {
 		ids.push_back(window.id);
-		vertices.push_back(window.vertices[0]);
-		vertices.push_back(window.vertices[1]);
-		vertices.push_back(window.vertices[2]);
-		vertices.push_back(window.vertices[3]);
+		for (int i = 0; i < 4; i++) {
+			xs.push_back((T)(window.vertices[i].x * width));
+			ys.push_back((T)(window.vertices[i].y * height));
+		}
 	}
 }
 
-bool WindowStructure::isValidWindow(int index, int width, int height) const {
-	return vertices[(size_t)index * 4].x >= 0 && vertices[(size_t)index * 4].x < width &&
-		vertices[(size_t)index * 4].y >= 0 && vertices[(size_t)index * 4].y < height &&
-		vertices[(size_t)index * 4 + 1].x >= 0 && vertices[(size_t)index * 4 + 1].x < width &&
-		vertices[(size_t)index * 4 + 1].y >= 0 && vertices[(size_t)index * 4 + 1].y < height &&
-		vertices[(size_t)index * 4 + 2].x >= 0 && vertices[(size_t)index * 4 + 2].x < width &&
-		vertices[(size_t)index * 4 + 2].y >= 0 && vertices[(size_t)index * 4 + 2].y < height &&
-		vertices[(size_t)index * 4 + 3].x >= 0 && vertices[(size_t)index * 4 + 3].x < width &&
-		vertices[(size_t)index * 4 + 3].y >= 0 && vertices[(size_t)index * 4 + 3].y < height;
+template <class T>
+void WindowStructureT<T>::set(const vector<Window<T>>& windows) {
+	clear();
+
+	for (const Window<T>& window : windows)
+		pushWindow(window);
+}
+
+// 4 vertices of a window are in [0, width) x [0, height)
+#ifdef GIS_SSE2
+static inline bool isInsideImage(const float* xs, const float* ys, int width, int height) {
+	__m128 x = _mm_loadu_ps(xs), y = _mm_loadu_ps(ys), zero = _mm_setzero_ps();
+	__m128 inside = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(x, zero), _mm_cmplt_ps(x, _mm_set1_ps((float)width))),
+		_mm_and_ps(_mm_cmpge_ps(y, zero), _mm_cmplt_ps(y, _mm_set1_ps((float)height))));
+	return _mm_movemask_ps(inside) == 0xF;
+}
+
+static inline bool isInsideImage(const int* xs, const int* ys, int width, int height) {
+	__m128i x = _mm_loadu_si128((const __m128i*)xs), y = _mm_loadu_si128((const __m128i*)ys), zero = _mm_setzero_si128();
+	__m128i inside = _mm_and_si128(_mm_andnot_si128(_mm_cmplt_epi32(x, zero), _mm_cmplt_epi32(x, _mm_set1_epi32(width))),
+		_mm_andnot_si128(_mm_cmplt_epi32(y, zero), _mm_cmplt_epi32(y, _mm_set1_epi32(height))));
+	return _mm_movemask_epi8(inside) == 0xFFFF;
+}
+#else
+template <class T>
+static inline bool isInsideImage(const T* xs, const T* ys, int width, int height) {
+	for (int i = 0; i < 4; i++)
+		if (!(xs[i] >= 0 && xs[i] < width && ys[i] >= 0 && ys[i] < height))
+			return false;
+	return true;
+}
+#endif
+
+template <class T>
+bool WindowStructureT<T>::isValidWindow(int index, int width, int height) const {
+	return isInsideImage(&xs[(size_t)index * 4], &ys[(size_t)index * 4], width, height);
 }
 
-void WindowStructure::checkVaildWindow(int width, int height, vector<bool>& valids) const {
+template <class T>
+void WindowStructureT<T>::checkVaildWindow(int width, int height, vector<bool>& valids) const {
 	valids.resize(size());
 	for (int i = 0; i < this->size(); i++) 
 		valids[i] = isValidWindow(i, width, height);
 }
 
-void WindowStructure::perspectiveXform(Mat& homographyMat) {
-	vector<Point2f> xformedPoints(this->size() * 4);
-	vector<Point2f> originPoints(this->size() * 4);
+// as cv::perspectiveTransform does in double, vertex whose w is about 0 goes to origin
+static inline Point2d xformVertex(const double* h, double x, double y) {
+	double w = h[6] * x + h[7] * y + h[8];
+	if (fabs(w) <= FLT_EPSILON)
+		return Point2d(0, 0);
+	w = 1 / w;
+	return Point2d((h[0] * x + h[1] * y + h[2]) * w, (h[3] * x + h[4] * y + h[5]) * w);
+}
 
-	for (int i = 0; i < this->size(); i++) {
-		originPoints[(size_t)i * 4].x = (float)this->vertices[(size_t)i * 4].x;
-		originPoints[(size_t)i * 4].y = (float)this->vertices[(size_t)i * 4].y;
-		originPoints[(size_t)i * 4 + 1].x = (float)this->vertices[(size_t)i * 4 + 1].x;
-		originPoints[(size_t)i * 4 + 1].y = (float)this->vertices[(size_t)i * 4 + 1].y;
-		originPoints[(size_t)i * 4 + 2].x = (float)this->vertices[(size_t)i * 4 + 2].x;
-		originPoints[(size_t)i * 4 + 2].y = (float)this->vertices[(size_t)i * 4 + 2].y;
-		originPoints[(size_t)i * 4 + 3].x = (float)this->vertices[(size_t)i * 4 + 3].x;
-		originPoints[(size_t)i * 4 + 3].y = (float)this->vertices[(size_t)i * 4 + 3].y;
-	}
-	perspectiveTransform(originPoints, xformedPoints, homographyMat);
-	for (int i = 0; i < this->size(); i++) {
-		this->vertices[(size_t)i * 4].x = (int)xformedPoints[(size_t)i * 4].x;
-		this->vertices[(size_t)i * 4].y = (int)xformedPoints[(size_t)i * 4].y;
-		this->vertices[(size_t)i * 4 + 1].x = (int)xformedPoints[(size_t)i * 4 + 1].x;
-		this->vertices[(size_t)i * 4 + 1].y = (int)xformedPoints[(size_t)i * 4 + 1].y;
-		this->vertices[(size_t)i * 4 + 2].x = (int)xformedPoints[(size_t)i * 4 + 2].x;
-		this->vertices[(size_t)i * 4 + 2].y = (int)xformedPoints[(size_t)i * 4 + 2].y;
-		this->vertices[(size_t)i * 4 + 3].x = (int)xformedPoints[(size_t)i * 4 + 3].x;
-		this->vertices[(size_t)i * 4 + 3].y = (int)xformedPoints[(size_t)i * 4 + 3].y;
+// separate x and y arrays as source of xformVertices
+template <class T>
+struct PlanarPoints {
+	const T* xs;
+	const T* ys;
+};
+
+template <class T>
+static inline Point2d getPoint(const PlanarPoints<T>& points, size_t i) {
+	return Point2d(points.xs[i], points.ys[i]);
+}
+
+static inline Point2d getPoint(const Point2f* points, size_t i) {
+	return Point2d(points[i].x, points[i].y);
+}
+
+// int vertices are truncated through float as windows were transformed as Point2f before
+static inline void storeVertex(const Point2d& point, int& x, int& y) {
+	x = (int)(float)point.x;
+	y = (int)(float)point.y;
+}
+
+static inline void storeVertex(const Point2d& point, float& x, float& y) {
+	x = (float)point.x;
+	y = (float)point.y;
+}
+
+#ifdef GIS_SSE2
+// points i and i + 1 into x and y lanes
+static inline void loadPoints(const PlanarPoints<int>& points, size_t i, __m128d& xs, __m128d& ys) {
+	xs = _mm_cvtepi32_pd(_mm_loadl_epi64((const __m128i*)(points.xs + i)));
+	ys = _mm_cvtepi32_pd(_mm_loadl_epi64((const __m128i*)(points.ys + i)));
+}
+
+static inline void loadPoints(const PlanarPoints<float>& points, size_t i, __m128d& xs, __m128d& ys) {
+	xs = _mm_cvtps_pd(_mm_castpd_ps(_mm_load_sd((const double*)(points.xs + i))));
+	ys = _mm_cvtps_pd(_mm_castpd_ps(_mm_load_sd((const double*)(points.ys + i))));
+}
+
+static inline void loadPoints(const Point2f* points, size_t i, __m128d& xs, __m128d& ys) {
+	__m128 v = _mm_loadu_ps((const float*)(points + i));
+	v = _mm_shuffle_ps(v, v, _MM_SHUFFLE(3, 1, 2, 0));
+	xs = _mm_cvtps_pd(v);
+	ys = _mm_cvtps_pd(_mm_movehl_ps(v, v));
+}
+
+// 2 points of x and y lanes
+static inline void storePoints(__m128d xs, __m128d ys, int* dstXs, int* dstYs) {
+	_mm_storel_epi64((__m128i*)dstXs, _mm_cvttps_epi32(_mm_cvtpd_ps(xs)));
+	_mm_storel_epi64((__m128i*)dstYs, _mm_cvttps_epi32(_mm_cvtpd_ps(ys)));
+}
+
+static inline void storePoints(__m128d xs, __m128d ys, float* dstXs, float* dstYs) {
+	_mm_storel_pi((__m64*)dstXs, _mm_cvtpd_ps(xs));
+	_mm_storel_pi((__m64*)dstYs, _mm_cvtpd_ps(ys));
+}
+#endif
+
+// transform count points of src into dstXs and dstYs, src may be them
+template <class Src, class T>
+static void xformVertices(const double* h, const Src& src, size_t count, T* dstXs, T* dstYs) {
+	size_t i = 0;
+#ifdef GIS_SSE2
+	const __m128d h0 = _mm_set1_pd(h[0]), h1 = _mm_set1_pd(h[1]), h2 = _mm_set1_pd(h[2]);
+	const __m128d h3 = _mm_set1_pd(h[3]), h4 = _mm_set1_pd(h[4]), h5 = _mm_set1_pd(h[5]);
+	const __m128d h6 = _mm_set1_pd(h[6]), h7 = _mm_set1_pd(h[7]), h8 = _mm_set1_pd(h[8]);
+	const __m128d epsilon = _mm_set1_pd(FLT_EPSILON), signMask = _mm_set1_pd(-0.);
+	for (; i + 2 <= count; i += 2) {
+		__m128d xs, ys;
+		loadPoints(src, i, xs, ys);
+		__m128d w = _mm_add_pd(_mm_add_pd(_mm_mul_pd(h6, xs), _mm_mul_pd(h7, ys)), h8);
+		__m128d valid = _mm_cmpgt_pd(_mm_andnot_pd(signMask, w), epsilon);
+		w = _mm_and_pd(valid, _mm_div_pd(_mm_set1_pd(1), w));
+		__m128d x = _mm_mul_pd(_mm_add_pd(_mm_add_pd(_mm_mul_pd(h0, xs), _mm_mul_pd(h1, ys)), h2), w);
+		__m128d y = _mm_mul_pd(_mm_add_pd(_mm_add_pd(_mm_mul_pd(h3, xs), _mm_mul_pd(h4, ys)), h5), w);
+		storePoints(x, y, dstXs + i, dstYs + i);
+	}
+#endif
+	for (; i < count; i++) {
+		Point2d point = getPoint(src, i);
+		storeVertex(xformVertex(h, point.x, point.y), dstXs[i], dstYs[i]);
 	}
 }
 
-int getMarkerMatchHomography(vector<MarkerI>& srcMarkers, vector<MarkerI>& dstMarkers, Mat& h) {
-	h = Mat(Size(3, 3), CV_64FC1);
-	sort(srcMarkers.begin(), srcMarkers.end());
-	sort(dstMarkers.begin(), dstMarkers.end());
+// homography as 9 doubles in row major
+static Matx33d getHomography(const Mat& homographyMat) {
+	Matx33d h;
+	Mat hMat(h);
+	homographyMat.convertTo(hMat, CV_64F);
+	return h;
+}
 
-	vector<Point2f> srcPoints, dstPoints;
-	for (vector<MarkerI>::const_iterator pSrcMarkerIter = srcMarkers.begin(), pDstMarkerIter = dstMarkers.begin();
+template <class T>
+void WindowStructureT<T>::perspectiveXform(const Mat& homographyMat) {
+	Matx33d h = getHomography(homographyMat);
+	PlanarPoints<T> points = { xs.data(), ys.data() };
+	xformVertices(h.val, points, xs.size(), xs.data(), ys.data());
+}
+
+template <class T>
+void WindowStructureT<T>::perspectiveXformParallel(const Mat& homographyMat) {
+	if (xs.size() < PARALLEL_XFORM_MIN_VERTICES) {
+		perspectiveXform(homographyMat);
+		return;
+	}
+	Matx33d h = getHomography(homographyMat);
+	T* pXs = xs.data();
+	T* pYs = ys.data();
+	size_t count = xs.size();
+	// stripes split at window boundaries
+	parallel_for_(Range(0, (int)size()), [&](const Range& range) {
+		size_t begin = (size_t)range.start * 4, end = min((size_t)range.end * 4, count);
+		PlanarPoints<T> points = { pXs + begin, pYs + begin };
+		xformVertices(h.val, points, end - begin, pXs + begin, pYs + begin);
+	}, (double)count / PARALLEL_XFORM_MIN_VERTICES);
+}
+
+template <class T>
+void WindowStructureT<T>::pushXformedWindows(const vector<int>& windowIds, const vector<Point2f>& windowVertices,
+	const Mat& homographyMat) {
+	if (windowIds.empty())
+		return;
+	Matx33d h = getHomography(homographyMat);
+	size_t offset = xs.size();
+	ids.insert(ids.end(), windowIds.begin(), windowIds.end());
+	xs.resize(offset + windowVertices.size());
+	ys.resize(offset + windowVertices.size());
+	xformVertices(h.val, windowVertices.data(), windowVertices.size(), xs.data() + offset, ys.data() + offset);
+}
+
+// collect locations of markers which have same id, both markers shall be sorted by id
+template <class SrcMarkers, class DstMarkers, class Points>
+static void matchMarkers(const SrcMarkers& srcMarkers, const DstMarkers& dstMarkers, Points& srcPoints, Points& dstPoints) {
+	for (auto pSrcMarkerIter = srcMarkers.begin(), pDstMarkerIter = dstMarkers.begin();
 		pSrcMarkerIter != srcMarkers.end() && pDstMarkerIter != dstMarkers.end(); ) {
-		MarkerI srcMarker = *pSrcMarkerIter;
-		MarkerI dstMarker = *pDstMarkerIter;
-		if (srcMarker == dstMarker) {
-			srcPoints.push_back(srcMarker.location);
-			dstPoints.push_back(dstMarker.location);
+		if (pSrcMarkerIter->id == pDstMarkerIter->id) {
+			srcPoints.push_back(Point2f((float)pSrcMarkerIter->location.x, (float)pSrcMarkerIter->location.y));
+			dstPoints.push_back(Point2f((float)pDstMarkerIter->location.x, (float)pDstMarkerIter->location.y));
 			pSrcMarkerIter++;
 			pDstMarkerIter++;
 		}
-		else if (srcMarker < dstMarker)
+		else if (pSrcMarkerIter->id < pDstMarkerIter->id)
 			pSrcMarkerIter++;
 		else
 			pDstMarkerIter++;
 	}
+}
+
+int getMarkerMatchHomography(vector<MarkerI>& srcMarkers, vector<MarkerI>& dstMarkers, Mat& h) {
+	h = Mat(Size(3, 3), CV_64FC1);
+	sort(srcMarkers.begin(), srcMarkers.end());
+	sort(dstMarkers.begin(), dstMarkers.end());
+
+	vector<Point2f> srcPoints, dstPoints;
+	matchMarkers(srcMarkers, dstMarkers, srcPoints, dstPoints);
 
 	if (srcPoints.size() < 4) {
 		wcerr << "Matched Marker have to be more than or equal to 4" << endl;
@@ -331,7 +718,26 @@ int getMarkerMatchHomography(vector<MarkerI>& srcMarkers, vector<MarkerI>& dstMa
 	return 0;
 }
 
-void drawWindows(cv::Mat& img, const WindowStructure& winStruct, const vector<string>& windowNames) {
+int getMarkerMatchHomography(const vector<MarkerD>& srcMarkers, const vector<MarkerD>& dstMarkers, Mat& h,
+	pmr::memory_resource* scratch) {
+	h = Mat(Size(3, 3), CV_64FC1);
+
+	pmr::vector<Point2f> srcPoints(scratch), dstPoints(scratch);
+	srcPoints.reserve(dstMarkers.size());
+	dstPoints.reserve(dstMarkers.size());
+	matchMarkers(srcMarkers, dstMarkers, srcPoints, dstPoints);
+
+	if (srcPoints.size() < 4) {
+		wcerr << "Matched Marker have to be more than or equal to 4" << endl;
+		return -1;
+	}
+	h = findHomography(Mat((int)srcPoints.size(), 1, CV_32FC2, srcPoints.data()),
+		Mat((int)dstPoints.size(), 1, CV_32FC2, dstPoints.data()));
+	return 0;
+}
+
+template <class T>
+void drawWindows(cv::Mat& img, const WindowStructureT<T>& winStruct, const vector<string>& windowNames) {
 	vector<bool> valids;
 	winStruct.checkVaildWindow(img.size().width, img.size().height, valids);
 	for (int i = 0; i < winStruct.size(); i++)
@@ -339,29 +745,36 @@ void drawWindows(cv::Mat& img, const WindowStructure& winStruct, const vector<st
 			winStruct.drawWindow(img, i, windowNames);
 }
 
-void WindowStructure::drawWindow(cv::Mat& img, int index, const vector<string>& windowNames) const {
-	putText(img, windowNames[this->ids[(size_t)index]], vertices[(size_t)index * 4], FONT_HERSHEY_COMPLEX, 1, Scalar(0, 0, 255));
-	line(img, vertices[(size_t)index * 4], vertices[(size_t)index * 4 + 1], Scalar(0, 0, 255), 2);
-	line(img, vertices[(size_t)index * 4 + 1], vertices[(size_t)index * 4 + 2], Scalar(0, 0, 255), 2);
-	line(img, vertices[(size_t)index * 4 + 2], vertices[(size_t)index * 4 + 3], Scalar(0, 0, 255), 2);
-	line(img, vertices[(size_t)index * 4 + 3], vertices[(size_t)index * 4], Scalar(0, 0, 255), 2);
+template void drawWindows(cv::Mat& img, const WindowStructureI& winStruct, const vector<string>& windowNames);
+template void drawWindows(cv::Mat& img, const WindowStructureF& winStruct, const vector<string>& windowNames);
+
+template <class T>
+void WindowStructureT<T>::drawWindow(cv::Mat& img, int index, const vector<string>& windowNames) const {
+	Point2i pixels[4];
+	for (int i = 0; i < 4; i++)
+		pixels[i] = getVertex((size_t)index * 4 + i);
+	putText(img, windowNames[this->ids[(size_t)index]], pixels[0], FONT_HERSHEY_COMPLEX, 1, Scalar(0, 0, 255));
+	line(img, pixels[0], pixels[1], Scalar(0, 0, 255), 2);
+	line(img, pixels[1], pixels[2], Scalar(0, 0, 255), 2);
+	line(img, pixels[2], pixels[3], Scalar(0, 0, 255), 2);
+	line(img, pixels[3], pixels[0], Scalar(0, 0, 255), 2);
 }
 
-void WindowStructure::getWindows(std::vector<WindowI>& windows) const {
+template <class T>
+void WindowStructureT<T>::getWindows(std::vector<Window<T>>& windows) const {
 	for (int i = 0; i < this->size(); i++) {
-		WindowI window;
+		Window<T> window;
 		window.id = ids[i];
-		window.vertices[0] = vertices[(size_t)4 * i];
-		window.vertices[1] = vertices[(size_t)4 * i + 1];
-		window.vertices[2] = vertices[(size_t)4 * i + 2];
-		window.vertices[3] = vertices[(size_t)4 * i + 3];
+		for (int j = 0; j < 4; j++)
+			window.vertices[j] = getVertex((size_t)4 * i + j);
 		windows.push_back(window);
 	}
 }
 
 int getDoubledArea(const WindowI& window) {
-	vector<Point2i> vertices(window.vertices, window.vertices + 4);
-	return getDoubledArea(vertices);
+	const Point2i* v = window.vertices;
+	int dArea = (v[0].x - v[2].x) * (v[1].y - v[3].y) - (v[1].x - v[3].x) * (v[0].y - v[2].y);
+	return dArea > 0 ? dArea : -dArea;
 }
 
 int getDoubledArea(const std::vector<cv::Point2i>& points) {
@@ -451,6 +864,90 @@ int getDoubledIntersectedArea(const std::vector<cv::Point2i>& polygon1, const st
 	return getDoubledArea(vertices);
 }
 
+// signed doubled area of polygon, its sign is the orientation of vertices
+static inline double getSignedDoubledArea(const Point2d* points, int size) {
+	double dArea = 0;
+	for (int i = 0, j = size - 1; i < size; j = i++)
+		dArea += points[j].x * points[i].y - points[j].y * points[i].x;
+	return dArea;
+}
+
+// convex and in the order of orientation(+1 or -1), not degenerated
+static bool isConvexQuad(const Point2d quad[4], int orientation) {
+	for (int i = 0; i < 4; i++) {
+		const Point2d& p0 = quad[i];
+		const Point2d& p1 = quad[(i + 1) & 3];
+		const Point2d& p2 = quad[(i + 2) & 3];
+		double cross = (p1.x - p0.x) * (p2.y - p1.y) - (p1.y - p0.y) * (p2.x - p1.x);
+		if (cross * orientation < 0)
+			return false;
+	}
+	return true;
+}
+
+// clip convex subject by convex clip polygon with Sutherland-Hodgman on fixed size arrays.
+// a convex quadrangle clipped by 4 half planes has 8 vertices at most
+static double clipConvexQuad(const Point2d subject[4], const Point2d clip[4], double orientation) {
+	Point2d buffers[2][8];
+	Point2d* input = buffers[0];
+	Point2d* output = buffers[1];
+	int numInput = 4;
+	for (int i = 0; i < 4; i++)
+		input[i] = subject[i];
+
+	for (int e = 0; e < 4 && numInput > 0; e++) {
+		const Point2d& a = clip[e];
+		const Point2d& b = clip[(e + 1) & 3];
+		double edgeX = b.x - a.x, edgeY = b.y - a.y;
+		int numOutput = 0;
+		Point2d prev = input[numInput - 1];
+		double prevSide = (edgeX * (prev.y - a.y) - edgeY * (prev.x - a.x)) * orientation;
+		for (int i = 0; i < numInput; i++) {
+			Point2d cur = input[i];
+			double curSide = (edgeX * (cur.y - a.y) - edgeY * (cur.x - a.x)) * orientation;
+			if ((curSide >= 0) != (prevSide >= 0)) {
+				double t = prevSide / (prevSide - curSide);
+				output[numOutput++] = Point2d(prev.x + (cur.x - prev.x) * t, prev.y + (cur.y - prev.y) * t);
+			}
+			if (curSide >= 0)
+				output[numOutput++] = cur;
+			prev = cur;
+			prevSide = curSide;
+		}
+		swap(input, output);
+		numInput = numOutput;
+	}
+	if (numInput < 3)
+		return 0;
+	double dArea = getSignedDoubledArea(input, numInput);
+	return dArea > 0 ? dArea : -dArea;
+}
+
+template <class T>
+static double getDoubledIntersectedQuadArea(const Point_<T>* quad1, const Point_<T>* quad2) {
+	Point2d subject[4], clip[4];
+	for (int i = 0; i < 4; i++) {
+		subject[i] = Point2d(quad1[i].x, quad1[i].y);
+		clip[i] = Point2d(quad2[i].x, quad2[i].y);
+	}
+	double area1 = getSignedDoubledArea(subject, 4);
+	double area2 = getSignedDoubledArea(clip, 4);
+	if (area1 == 0 || area2 == 0)
+		return 0;
+
+	int orientation2 = area2 > 0 ? 1 : -1;
+	if (isConvexQuad(subject, area1 > 0 ? 1 : -1) && isConvexQuad(clip, orientation2))
+		return clipConvexQuad(subject, clip, orientation2);
+
+	// concave or self intersected quadrangle, on pixels
+	vector<Point2i> vertices1(quad1, quad1 + 4), vertices2(quad2, quad2 + 4);
+	return getDoubledIntersectedArea(vertices1, vertices2);
+}
+
+double getDoubledIntersectedArea(const cv::Point2i (&quad1)[4], const cv::Point2i (&quad2)[4]) {
+	return getDoubledIntersectedQuadArea(quad1, quad2);
+}
+
 bool findIntersectedPointOfLine(const cv::Point2i p1ofLine1, const cv::Point2i p2ofLine1,
 	const cv::Point2i p1ofLine2, const cv::Point2i p2ofLine2, cv::Point2i& intersectedPoint) {
 	// find x coordinate bound
@@ -635,15 +1132,17 @@ void drawMarkers(cv::Mat& img, const std::vector<MarkerI>& markers, const vector
 	}
 }
 
-WindowStructure& WindowStructure::operator+=(WindowStructure& other) {
-	for (int i = 0; i < other.ids.size(); i++) {
-		this->ids.push_back(other.ids[i]);
-		for (int j = 0; j < 4; j++)
-			this->vertices.push_back(other.vertices[i * 4 + j]);
-	}
+template <class T>
+WindowStructureT<T>& WindowStructureT<T>::operator+=(WindowStructureT<T>& other) {
+	ids.insert(ids.end(), other.ids.begin(), other.ids.end());
+	xs.insert(xs.end(), other.xs.begin(), other.xs.end());
+	ys.insert(ys.end(), other.ys.begin(), other.ys.end());
 	return *this;
 }
 
+template class WindowStructureT<int>;
+template class WindowStructureT<float>;
+
 void transformTest() {
 	/*string refWindowFileName = "ref_CheonnongHallFront1_window.txt";
 	string refMarkerFileName = "ref_CheonnongHallFront1_marker.txt";
@@ -3,6 +3,7 @@
 
 #include <vector>
 #include <cmath>
+#include <memory_resource>
 
 #include <opencv2/core.hpp>
 #include <opencv2/imgcodecs.hpp>
@@ -38,6 +39,9 @@ const double NORMALIZED_X_PER_LONGITUDE = DIST_PER_LONGITUDE / DIST_PER_NORMALIZ
 constexpr double NORMALIZED_Y_PER_LATITUDE = DIST_PER_LATITUDE / DIST_PER_NORMALIZED_Y;
 constexpr double NORMALIZED_Z_PER_ALTITUDE = 1 / DIST_PER_NORMALIZED_Z;
 
+// perspectiveXformParallel runs on the calling thread below it, and gives each thread stripes of about it
+constexpr size_t PARALLEL_XFORM_MIN_VERTICES = 16384;
+
 constexpr int DEFAULT_PLANE_PLOT_WIDTH = 1280;
 constexpr int DEFAULT_PLANE_PLOT_HEIGHT = 720;
 
@@ -156,6 +160,8 @@ int getDoubledArea(const WindowI& window);
 int getDoubledArea(const std::vector<cv::Point2i>& points);
 // get doubled intersected area of two polygons
 int getDoubledIntersectedArea(const std::vector<cv::Point2i>& vertices1, const std::vector<cv::Point2i>& vertices2);
+// get doubled intersected area of two quadrangles, convex ones are clipped without allocation
+double getDoubledIntersectedArea(const cv::Point2i (&quad1)[4], const cv::Point2i (&quad2)[4]);
 // get IOU of two polygons
 double getIOU(const std::vector<cv::Point2i>& vertices1, const std::vector<cv::Point2i>& vertices2);
 // get IOU of two windows
@@ -168,53 +174,105 @@ bool findIntersectedPointOfLine(const cv::Point2i p1ofLine1, const cv::Point2i p
 bool findIntersectedPointOfSLine(const cv::Point2i p1ofLine1, const cv::Point2i p2ofLine1,
 	const cv::Point2i p1ofLine2, const cv::Point2i p2ofLine2, cv::Point2i& intersectedPoint);
 
-class WindowStructure {
+// windows of coordinate type T, 4 vertices per window. float is the native type of projection pipeline,
+// so chained transforms don't drift by truncation. int is kept as a view for drawing.
+// coordinates are kept in structure of arrays, so vertices of a window are 4 adjacent lanes of xs and ys
+template <class T>
+class WindowStructureT {
 	bool isValidWindow(int index, int width, int height) const;
 public:
 	vector<int> ids;
-	vector<cv::Point2i> vertices;
+	vector<T> xs; // 4 per window
+	vector<T> ys;
 
-	WindowStructure(const vector<Window<double>*>& windows, int width, int height) {
+	WindowStructureT(const vector<Window<double>*>& windows, int width, int height) {
 		set(windows, width, height);
 	}
-	WindowStructure(const vector<Window<double>>& windows, int width, int height) {
+	WindowStructureT(const vector<Window<double>>& windows, int width, int height) {
 		set(windows, width, height);
 	}
-	WindowStructure(const vector<WindowI>& windows) { set(windows); }
-	WindowStructure() {}
+	WindowStructureT(const vector<Window<T>>& windows) { set(windows); }
+	WindowStructureT() {}
+	// converted from other coordinate type, int coordinates are rounded
+	template <class U>
+	explicit WindowStructureT(const WindowStructureT<U>& other) : ids(other.ids) {
+		xs.reserve(other.xs.size());
+		ys.reserve(other.ys.size());
+		for (size_t i = 0; i < other.xs.size(); i++) {
+			xs.push_back(cv::saturate_cast<T>(other.xs[i]));
+			ys.push_back(cv::saturate_cast<T>(other.ys[i]));
+		}
+	}
 
-	WindowStructure& operator+=(WindowStructure& other);
+	WindowStructureT& operator+=(WindowStructureT& other);
 
 	size_t size() const { return ids.size(); }
-	void pushWindow(Window<int> window) {
+	cv::Point_<T> getVertex(size_t index) const { return cv::Point_<T>(xs[index], ys[index]); }
+	// vertices interleaved as the former vertices member, copied from xs and ys
+	vector<cv::Point_<T>> getVertices() const {
+		vector<cv::Point_<T>> vertices(xs.size());
+		for (size_t i = 0; i < vertices.size(); i++)
+			vertices[i] = getVertex(i);
+		return vertices;
+	}
+	void pushWindow(Window<T> window) {
 		ids.push_back(window.id);
-		for (int i = 0; i < 4; i++)
-			vertices.push_back(window.vertices[i]);
+		for (int i = 0; i < 4; i++) {
+			xs.push_back(window.vertices[i].x);
+			ys.push_back(window.vertices[i].y);
+		}
+	}
+	void clear() {
+		ids.clear();
+		xs.clear();
+		ys.clear();
 	}
 	void set(const vector<Window<double>*>& windows, int width, int height);
 	void set(const vector<Window<double>>& windows, int width, int height);
-	void set(const vector<Window<int>>& windows);
+	void set(const vector<Window<T>>& windows);
 	void checkVaildWindow(int width, int height, vector<bool>& valids) const;
-	void perspectiveXform(cv::Mat& homographyMat);
+	// transform vertices in place, without temporaries
+	void perspectiveXform(const cv::Mat& homographyMat);
+	// same as perspectiveXform, split into stripes of windows over threads if there are many vertices
+	void perspectiveXformParallel(const cv::Mat& homographyMat);
+	// push windows whose vertices(4 per window) are transformed by homographyMat
+	void pushXformedWindows(const vector<int>& windowIds, const vector<cv::Point2f>& windowVertices, const cv::Mat& homographyMat);
+	// vertices are rounded to pixels
 	void drawWindow(cv::Mat& img, int index, const std::vector<string>& windowNames) const;
-	void getWindows(std::vector<WindowI>& windows) const;
+	void getWindows(std::vector<Window<T>>& windows) const;
 };
 
+using WindowStructureI = WindowStructureT<int>;
+using WindowStructureF = WindowStructureT<float>;
+using WindowStructure = WindowStructureF;
+
 // get IOU of two vector<WindowI>, groundTruth shall not be include same window(same id)
 double getIOU(std::vector<WindowI>& windows, std::vector<WindowI>& groundTruth);
 // get IOU of two WindowStructure, groundTruth shall not be include same window(same id)
-double getIOU(WindowStructure& winStruct, WindowStructure& groundTruth);
+template <class T>
+double getIOU(const WindowStructureT<T>& winStruct, const WindowStructureT<T>& groundTruth);
+// IOU of every pair of windows, CV_32F matrix of pred.size() x gt.size(). pairs whose bounding boxes don't overlap
+// are 0 without intersecting them
+template <class T>
+cv::Mat computeIoUMatrix(const WindowStructureT<T>& pred, const WindowStructureT<T>& gt);
 
 void markerRelToAbsol(const MarkerD& relMarker, MarkerI& absolMarker, int width, int height);
 void windowRelToAbsol(const Window<double>& relWindow, Window<int>& absolWindow, int width, int height);
 
 int readMarkers(const std::string& fileName, vector<MarkerD>& markers);
 int readWindows(const std::string& fileName, vector<Window<double>*>& windows);
-int readWindows(const std::string& fileName, WindowStructure& windowStruct, int width, int height);
+int readWindows(const std::string& fileName, vector<Window<double>>& windows);
+// relative coordinates of file are scaled straight into windowStruct
+template <class T>
+int readWindows(const std::string& fileName, WindowStructureT<T>& windowStruct, int width, int height);
 
 int getMarkerMatchHomography(vector<MarkerI>& srcMarkers, vector<MarkerI>& dstMarkers, cv::Mat& h);
+// both srcMarkers and dstMarkers shall be sorted by id, temporaries are allocated from scratch
+int getMarkerMatchHomography(const vector<MarkerD>& srcMarkers, const vector<MarkerD>& dstMarkers, cv::Mat& h,
+	std::pmr::memory_resource* scratch = std::pmr::get_default_resource());
 
-void drawWindows(cv::Mat& img, const WindowStructure& winStruct, const std::vector<string>& windowNames);
+template <class T>
+void drawWindows(cv::Mat& img, const WindowStructureT<T>& winStruct, const std::vector<string>& windowNames);
 void drawMarkers(cv::Mat& img, const std::vector<MarkerI>& markers, const std::vector<string>& markerNames);
 
 // GPS coordinate to normalized coordinate (-1 ~ 1)
@@ -3,18 +3,51 @@
 #include <iostream>
 #include <filesystem>
 #include <cmath>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <chrono>
 
 #include "mysql.hpp"
 #include "detector.hpp"
+#include "utility.hpp"
+#include "fusedmodel.hpp"
+#include "quantized.hpp"
 
 using namespace std;
 
+constexpr int PIPELINE_READERS = 2;
+constexpr int PIPELINE_POST_WORKERS = 2;
+constexpr size_t PIPELINE_QUEUE_SIZE = 8;
+
+// an image and its results passed through stages of runImagePipeline
+struct ImageTask {
+	string fileName;
+	cv::Mat img;
+	cv::Size2i imageSize; // full resolution size, img may be decoded smaller
+	WindowStructure winStruct;
+	WindowStructure refWinSt;
+	double IoU = 0;
+};
+
 void doCmdTest(WinDetector& detector, const char* imgdir = nullptr);
-void doCmdIOU(WinDetector& detector, const string& testImgDir);
+// return average IOU
+double doCmdIOU(WinDetector& detector, const string& testImgDir);
+// calibrate int8 model with images of imgDir, then compare IOU and time of int8 backend with float one on images of
+// testImgDir, which shall be other images than calibration ones not to overrate int8 model
+int doCmdCalibrate(const string& dataFileName, const string& cfgFileName, const string& weightFileName, const string& imgDir,
+	const string& testImgDir);
 void doCmdIOUyolo(WinDetector& detector, const string& testImgDir);
 void doCmdTestYolo(WinDetector& detector, const char* imgDir = nullptr);
 
-enum CMD { TEST, IOU, TEST_YOLO, IOU_YOLO, UNKNOWN};
+// run jpg images of imgDir through stages connected by bounded queues, decoding and ground truth reading run on
+// reader threads, detect on a detector thread, postProcess on worker threads and consume on the calling thread
+// images are decoded by read if it is given, otherwise at full resolution
+void runImagePipeline(const string& imgDir, const function<void(ImageTask&)>& detect,
+	const function<void(ImageTask&)>& postProcess, const function<void(ImageTask&)>& consume,
+	const function<cv::Mat(const string&, cv::Size2i&)>& read = nullptr);
+
+enum CMD { TEST, IOU, TEST_YOLO, IOU_YOLO, COMPILE, CALIBRATE, UNKNOWN};
 
 int main(int argc, char* argv[]) {
 	if (argc < 5) {
@@ -44,11 +77,27 @@ int main(int argc, char* argv[]) {
 		}
 		cmd = IOU_YOLO;
 	}
+	else if (cmdS.compare("compile") == 0)
+		cmd = COMPILE;
+	else if (cmdS.compare("calibrate") == 0) {
+		if (argc < 7) {
+			cout << "calibration or test img directory isn't designated" << endl;
+			cout << "Usage: program.exe calibrate <data file> <YOLO cfg file> <weights file> <calibration imgs dir> <test imgs dir>" << endl;
+			return 0;
+		}
+		cmd = CALIBRATE;
+	}
 	else {
 		cout << "Unknown command " << cmdS << endl;
 		return 0;
 	}
 
+	// write fused model which is loaded instead of cfg and weights from next start
+	if (cmd == COMPILE)
+		return compileFusedModel(argv[3], argv[4]) < 0 ? -1 : 0;
+	if (cmd == CALIBRATE)
+		return doCmdCalibrate(argv[2], argv[3], argv[4], argv[5], argv[6]) < 0 ? -1 : 0;
+
 	WinDetector detector(argv[2], argv[3], argv[4]);
 	if (!detector) {
 		cerr << "fail to initialize detector" << endl;
@@ -88,8 +137,9 @@ void doCmdTest(WinDetector& detector, const char* imgDir) {
 			cout << "enter image file name: ";
 			cin >> imgFileName;
 			string fileNameWOExt = imgFileName.substr(0, imgFileName.size() - 4);
-			detector.detect(imgFileName, winStruct, true);
 			cv::Mat img = cv::imread(imgFileName);
+			if (detector.detect(img, winStruct, true, 0.2f, false, imgFileName) < 0)
+				continue;
 			drawWindows(img, winStruct, detector.windowNames);
 			readWindows(fileNameWOExt + "_quadrangle.txt", refStructure, img.size().width, img.size().height);
 			double IoU = getIOU(winStruct, refStructure);
@@ -102,77 +152,105 @@ void doCmdTest(WinDetector& detector, const char* imgDir) {
 		}
 	}
 	else {
-		for (const auto& entry : filesystem::directory_iterator(imgDir)) {
-			WindowStructure winStruct, refStructure;
-			string imgFileName = entry.path().generic_string();
-			string fileNameWOExt = imgFileName.substr(0, imgFileName.size() - 4);
-			if (imgFileName.substr(imgFileName.size() - 3).compare("jpg") == 0) {
-				detector.detect(imgFileName, winStruct, true);
-				cv::Mat img = cv::imread(imgFileName);
-				drawWindows(img, winStruct, detector.windowNames);
-				readWindows(fileNameWOExt + "_quadrangle.txt", refStructure, img.size().width, img.size().height);
-				double IoU = getIOU(winStruct, refStructure);
-				cout << "IoU: " << IoU << endl;
-
-				cv::namedWindow(imgFileName, CV_WINDOW_NORMAL);
-				cv::imshow(imgFileName, img);
+		runImagePipeline(imgDir,
+			[&detector](ImageTask& task) {
+				detector.detect(task.img, task.winStruct, true, 0.2f, false, task.fileName);
+			},
+			[&detector](ImageTask& task) {
+				drawWindows(task.img, task.winStruct, detector.windowNames);
+				task.IoU = getIOU(task.winStruct, task.refWinSt);
+			},
+			[](ImageTask& task) {
+				cout << "IoU: " << task.IoU << endl;
+
+				cv::namedWindow(task.fileName, CV_WINDOW_NORMAL);
+				cv::imshow(task.fileName, task.img);
 				cv::waitKey();
-				cv::destroyWindow(imgFileName);
-			}
-		}
+				cv::destroyWindow(task.fileName);
+			});
 		return;		
 	}
 }
 
-void doCmdIOU(WinDetector& detector, const string& testImgDir) {
+double doCmdIOU(WinDetector& detector, const string& testImgDir) {
 	double totalIOU = 0;
 	int count = 0;
-	for (const auto& entry : std::filesystem::directory_iterator(testImgDir)) {
-		string fileName = entry.path().generic_string();
-		if (fileName.substr(fileName.size() - 3).compare("jpg") == 0) {
-			WindowStructure winStruct, refWinSt;
-			string fileNameWOExt = fileName.substr(0, fileName.size() - 4);
-			detector.detect(fileName, winStruct, false);
-			cv::Size2i imgSize = detector.lastDetectedImageSize;
-			readWindows(fileNameWOExt + "_quadrangle.txt", refWinSt, imgSize.width, imgSize.height);
-			double IOU = getIOU(winStruct, refWinSt);
-			cout << "image " << fileName << " IOU: " << IOU << endl;
-			if (isinf(IOU))
-				IOU = 0;
-			totalIOU += IOU;
+	runImagePipeline(testImgDir,
+		[&detector](ImageTask& task) {
+			DetectionResult result;
+			detector.detectFromMarkerBoxes(task.img, detector.detectMarkerBoxes(task.img), task.imageSize, result);
+			task.winStruct = move(result.winStruct);
+		},
+		[](ImageTask& task) { task.IoU = getIOU(task.winStruct, task.refWinSt); },
+		[&](ImageTask& task) {
+			cout << "image " << task.fileName << " IOU: " << task.IoU << endl;
+			if (isinf(task.IoU))
+				task.IoU = 0;
+			totalIOU += task.IoU;
 			count++;
+		},
+		[&detector](const string& fileName, cv::Size2i& fullSize) { return detector.readImage(fileName, fullSize); });
+	cout << "average IOU of " << count << " images: " << totalIOU / count << endl;
+	if (detector.isCascadeEnabled())
+		detector.printCascadeStats();
+	return totalIOU / count;
+}
+
+int doCmdCalibrate(const string& dataFileName, const string& cfgFileName, const string& weightFileName, const string& imgDir,
+	const string& testImgDir) {
+	error_code ec;
+	if (filesystem::equivalent(imgDir, testImgDir, ec)) {
+		cerr << "test img directory shall be other than calibration one" << endl;
+		return -1;
+	}
+	if (calibrateQuantizedModel(cfgFileName, weightFileName, imgDir) < 0)
+		return -1;
+
+	// float backend is the one of data file, or darknet
+	double ious[2], seconds[2];
+	string backendNames[2];
+	for (int i = 0; i < 2; i++) {
+		WinDetector detector(dataFileName, cfgFileName, weightFileName, 0, i == 0 ? "" : "int8");
+		if (!detector) {
+			cerr << "fail to initialize detector" << endl;
+			return -1;
 		}
+		backendNames[i] = detector.getBackendName();
+		auto start = chrono::steady_clock::now();
+		ious[i] = doCmdIOU(detector, testImgDir);
+		seconds[i] = chrono::duration<double>(chrono::steady_clock::now() - start).count();
 	}
-	cout << "average IOU of " << count << " images: " << totalIOU / count << endl;
+	cout << "accuracy of int8 model" << endl;
+	for (int i = 0; i < 2; i++)
+		cout << "  " << backendNames[i] << ": average IOU " << ious[i] << ", " << seconds[i] << " s" << endl;
+	cout << "  IOU difference: " << ious[1] - ious[0] << ", speedup: " << seconds[0] / seconds[1] << endl;
+	return 0;
 }
 
 void doCmdIOUyolo(WinDetector& detector, const string& testImgDir) {
-	Detector& yoloDetector = detector;
 	double totalIOU = 0;
 	int count = 0;
-	for (const auto& entry : std::filesystem::directory_iterator(testImgDir)) {
-		string fileName = entry.path().generic_string();
-		if (fileName.substr(fileName.size() - 3).compare("jpg") == 0) {
-			vector<bbox_t> bboxes;
-			WindowStructure winStruct, refWinSt;
-			string fileNameWOExt = fileName.substr(0, fileName.size() - 4);
-			bboxes = yoloDetector.detect(fileName);
-			setWindowStructure(bboxes, winStruct);
-			cv::Size2i imgSize = detector.lastDetectedImageSize;
-			readWindows(fileNameWOExt + "_quadrangle.txt", refWinSt, imgSize.width, imgSize.height);
-			double IOU = getIOU(winStruct, refWinSt);
-			cout << "image " << fileName << " IOU: " << IOU << endl;
-			if (isinf(IOU))
-				IOU = 0;
-			totalIOU += IOU;
+	runImagePipeline(testImgDir,
+		[&detector](ImageTask& task) {
+			DetectionResult result;
+			result.imageSize = task.img.size();
+			setWindowStructure(detector.detectBoxes(task.img), result.winStruct);
+			result.scaleTo(task.imageSize);
+			task.winStruct = move(result.winStruct);
+		},
+		[](ImageTask& task) { task.IoU = getIOU(task.winStruct, task.refWinSt); },
+		[&](ImageTask& task) {
+			cout << "image " << task.fileName << " IOU: " << task.IoU << endl;
+			if (isinf(task.IoU))
+				task.IoU = 0;
+			totalIOU += task.IoU;
 			count++;
-		}
-	}
+		},
+		[&detector](const string& fileName, cv::Size2i& fullSize) { return detector.readImage(fileName, fullSize); });
 	cout << "average IOU of " << count << " images: " << totalIOU / count << endl;
 }
 
 void doCmdTestYolo(WinDetector& detector, const char* imgDir) {
-	Detector& yoloDetector = detector;
 	if (imgDir == nullptr) {
 		string imgFileName;
 		while (true) {
@@ -181,8 +259,12 @@ void doCmdTestYolo(WinDetector& detector, const char* imgDir) {
 			cout << "enter image file name: ";
 			cin >> imgFileName;
 			string fileNameWOExt = imgFileName.substr(0, imgFileName.size() - 4);
-			bboxes = yoloDetector.detect(imgFileName);
 			cv::Mat img = cv::imread(imgFileName);
+			if (img.data == NULL) {
+				cerr << "img file " << imgFileName << " load fail" << endl;
+				continue;
+			}
+			bboxes = detector.detectBoxes(img);
 			setWindowStructure(bboxes, winStruct);
 			drawWindows(img, winStruct, detector.windowNames);
 			readWindows(fileNameWOExt + "_quadrangle.txt", refStructure, img.size().width, img.size().height);
@@ -196,26 +278,83 @@ void doCmdTestYolo(WinDetector& detector, const char* imgDir) {
 		}
 	}
 	else {
-		for (const auto& entry : filesystem::directory_iterator(imgDir)) {
-			string imgFileName = entry.path().generic_string();
-			if (imgFileName.substr(imgFileName.size() - 3).compare("jpg") == 0) {
-				WindowStructure winStruct, refStructure;
-				vector<bbox_t> bboxes;
-				string fileNameWOExt = imgFileName.substr(0, imgFileName.size() - 4);
-				bboxes = yoloDetector.detect(imgFileName);
-				setWindowStructure(bboxes, winStruct);
-				cv::Mat img = cv::imread(imgFileName);
-				drawWindows(img, winStruct, detector.windowNames);
-				readWindows(fileNameWOExt + "_quadrangle.txt", refStructure, img.size().width, img.size().height);
-				double IoU = getIOU(winStruct, refStructure);
-				cout << "IoU: " << IoU << endl;
-
-				cv::namedWindow(imgFileName, CV_WINDOW_NORMAL);
-				cv::imshow(imgFileName, img);
+		runImagePipeline(imgDir,
+			[&detector](ImageTask& task) { setWindowStructure(detector.detectBoxes(task.img), task.winStruct); },
+			[&detector](ImageTask& task) {
+				drawWindows(task.img, task.winStruct, detector.windowNames);
+				task.IoU = getIOU(task.winStruct, task.refWinSt);
+			},
+			[](ImageTask& task) {
+				cout << "IoU: " << task.IoU << endl;
+
+				cv::namedWindow(task.fileName, CV_WINDOW_NORMAL);
+				cv::imshow(task.fileName, task.img);
 				cv::waitKey();
-				cv::destroyWindow(imgFileName);
+				cv::destroyWindow(task.fileName);
+			});
+		return;
+	}
+}
+
+void runImagePipeline(const string& imgDir, const function<void(ImageTask&)>& detect,
+	const function<void(ImageTask&)>& postProcess, const function<void(ImageTask&)>& consume,
+	const function<cv::Mat(const string&, cv::Size2i&)>& read) {
+	vector<string> fileNames;
+	for (const auto& entry : filesystem::directory_iterator(imgDir)) {
+		string fileName = entry.path().generic_string();
+		if (fileName.substr(fileName.size() - 3).compare("jpg") == 0)
+			fileNames.push_back(fileName);
+	}
+
+	BoundedQueue<ImageTask> decodedQueue(PIPELINE_QUEUE_SIZE), detectedQueue(PIPELINE_QUEUE_SIZE),
+		doneQueue(PIPELINE_QUEUE_SIZE);
+	atomic<size_t> nextFile(0);
+	atomic<int> runningReaders(PIPELINE_READERS), runningPostWorkers(PIPELINE_POST_WORKERS);
+
+	vector<thread> threads;
+	for (int i = 0; i < PIPELINE_READERS; i++) {
+		threads.emplace_back([&] {
+			for (size_t index = nextFile++; index < fileNames.size(); index = nextFile++) {
+				ImageTask task;
+				task.fileName = fileNames[index];
+				if (read)
+					task.img = read(task.fileName, task.imageSize);
+				else {
+					task.img = cv::imread(task.fileName);
+					task.imageSize = task.img.size();
+				}
+				if (task.img.data == NULL) {
+					cerr << "img file " << task.fileName << " load fail" << endl;
+					continue;
+				}
+				string fileNameWOExt = task.fileName.substr(0, task.fileName.size() - 4);
+				readWindows(fileNameWOExt + "_quadrangle.txt", task.refWinSt, task.imageSize.width, task.imageSize.height);
+				decodedQueue.push(move(task));
 			}
+			if (--runningReaders == 0)
+				decodedQueue.close();
+		});
+	}
+	threads.emplace_back([&] {
+		for (ImageTask task; decodedQueue.pop(task);) {
+			detect(task);
+			detectedQueue.push(move(task));
 		}
-		return;
+		detectedQueue.close();
+	});
+	for (int i = 0; i < PIPELINE_POST_WORKERS; i++) {
+		threads.emplace_back([&] {
+			for (ImageTask task; detectedQueue.pop(task);) {
+				postProcess(task);
+				doneQueue.push(move(task));
+			}
+			if (--runningPostWorkers == 0)
+				doneQueue.close();
+		});
 	}
-}
\ No newline at end of file
+
+	for (ImageTask task; doneQueue.pop(task);)
+		consume(task);
+	for (thread& t : threads)
+		t.join();
+}
@@ -0,0 +1,587 @@
+#include "quantized.hpp"
+
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+#include <filesystem>
+#include <cmath>
+#include <cfloat>
+
+#include <opencv2/imgcodecs.hpp>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define QUANTIZED_SSE2
+#endif
+
+using namespace cv;
+using namespace std;
+
+static bool isConvolutional(const string& type) {
+	return type.compare("convolutional") == 0 || type.compare("conv") == 0;
+}
+
+static inline float activate(float x, const string& activation) {
+	switch (activation[0]) {
+	case 'l':
+		if (activation[1] == 'e') // leaky
+			return x > 0 ? x : .1f * x;
+		if (activation[1] == 'o') // logistic
+			return 1 / (1 + exp(-x));
+		return x; // linear
+	case 'r': // relu
+		return x > 0 ? x : 0;
+	case 'm': // mish
+		return x * tanh(x > 20 ? x : log1p(exp(x)));
+	case 's': // swish
+		return x / (1 + exp(-x));
+	}
+	return x;
+}
+
+static void activateArray(float* x, size_t size, const string& activation) {
+	if (activation.compare("linear") == 0)
+		return;
+	if (activation.compare("leaky") == 0) {
+		for (size_t i = 0; i < size; i++)
+			x[i] = x[i] > 0 ? x[i] : .1f * x[i];
+		return;
+	}
+	for (size_t i = 0; i < size; i++)
+		x[i] = activate(x[i], activation);
+}
+
+// rows of dst are the receptive fields of output pixels, zero padded to paddedFilterSize
+template <class T>
+static void im2col(const T* src, int width, int height, int channels, int size, int stride, int padding,
+	int outWidth, int outHeight, int paddedFilterSize, T* dst) {
+	parallel_for_(Range(0, outHeight), [&](const Range& range) {
+		for (int oy = range.start; oy < range.end; oy++) {
+			for (int ox = 0; ox < outWidth; ox++) {
+				T* col = dst + ((size_t)oy * outWidth + ox) * paddedFilterSize;
+				int k = 0;
+				for (int c = 0; c < channels; c++) {
+					const T* plane = src + (size_t)c * width * height;
+					for (int ky = 0; ky < size; ky++) {
+						int y = oy * stride + ky - padding;
+						for (int kx = 0; kx < size; kx++) {
+							int x = ox * stride + kx - padding;
+							col[k++] = (y >= 0 && y < height && x >= 0 && x < width) ? plane[(size_t)y * width + x] : 0;
+						}
+					}
+				}
+				for (; k < paddedFilterSize; k++)
+					col[k] = 0;
+			}
+		}
+	});
+}
+
+// dot products of col with 4 weight rows, size is multiple of 8
+static inline void dot4(const int16_t* col, const int16_t* weights, int size, int32_t sums[4]) {
+#ifdef QUANTIZED_SSE2
+	// 8 int16 multiply-adds into 4 int32 per instruction, int8 x int8 products never overflow the pairs
+	__m128i acc0 = _mm_setzero_si128(), acc1 = _mm_setzero_si128(), acc2 = _mm_setzero_si128(), acc3 = _mm_setzero_si128();
+	for (int k = 0; k < size; k += 8) {
+		__m128i x = _mm_loadu_si128((const __m128i*)(col + k));
+		acc0 = _mm_add_epi32(acc0, _mm_madd_epi16(x, _mm_loadu_si128((const __m128i*)(weights + k))));
+		acc1 = _mm_add_epi32(acc1, _mm_madd_epi16(x, _mm_loadu_si128((const __m128i*)(weights + size + k))));
+		acc2 = _mm_add_epi32(acc2, _mm_madd_epi16(x, _mm_loadu_si128((const __m128i*)(weights + size * 2 + k))));
+		acc3 = _mm_add_epi32(acc3, _mm_madd_epi16(x, _mm_loadu_si128((const __m128i*)(weights + size * 3 + k))));
+	}
+	// horizontal sums of 4 accumulators by transposing them
+	__m128i t0 = _mm_unpacklo_epi32(acc0, acc1), t1 = _mm_unpackhi_epi32(acc0, acc1);
+	__m128i t2 = _mm_unpacklo_epi32(acc2, acc3), t3 = _mm_unpackhi_epi32(acc2, acc3);
+	__m128i sum = _mm_add_epi32(_mm_add_epi32(_mm_unpacklo_epi64(t0, t2), _mm_unpackhi_epi64(t0, t2)),
+		_mm_add_epi32(_mm_unpacklo_epi64(t1, t3), _mm_unpackhi_epi64(t1, t3)));
+	_mm_storeu_si128((__m128i*)sums, sum);
+#else
+	for (int f = 0; f < 4; f++) {
+		int32_t sum = 0;
+		for (int k = 0; k < size; k++)
+			sum += col[k] * weights[(size_t)f * size + k];
+		sums[f] = sum;
+	}
+#endif
+}
+
+static inline int32_t dot(const int16_t* col, const int16_t* weights, int size) {
+	int32_t sum = 0;
+	for (int k = 0; k < size; k++)
+		sum += col[k] * weights[k];
+	return sum;
+}
+
+static inline float dot(const float* col, const float* weights, int size) {
+	float sum = 0;
+	for (int k = 0; k < size; k++)
+		sum += col[k] * weights[k];
+	return sum;
+}
+
+static inline int16_t quantize(float x, float invScale) {
+	int q = (int)lrintf(x * invScale);
+	return (int16_t)(q > 127 ? 127 : (q < -127 ? -127 : q));
+}
+
+void QuantizedNetwork::forwardConvolutional(Layer& layer, const float* input, int inWidth, int inHeight, int inChannels,
+	bool quantized) {
+	int filters = layer.channels;
+	int numPixels = layer.width * layer.height;
+	int paddedFilterSize = layer.paddedFilterSize;
+	float* output = layer.output.data();
+
+	if (!quantized) {
+		columns.resize((size_t)numPixels * paddedFilterSize);
+		im2col(input, inWidth, inHeight, inChannels, layer.size, layer.stride, layer.padding, layer.width, layer.height,
+			paddedFilterSize, columns.data());
+		parallel_for_(Range(0, numPixels), [&](const Range& range) {
+			for (int n = range.start; n < range.end; n++) {
+				const float* col = columns.data() + (size_t)n * paddedFilterSize;
+				for (int f = 0; f < filters; f++)
+					output[(size_t)f * numPixels + n] = dot(col, layer.weights.data() + (size_t)f * paddedFilterSize, paddedFilterSize) +
+					layer.biases[f];
+			}
+		});
+	}
+	else {
+		// quantize input once before im2col, which then copies 16 bit values instead of floats
+		size_t inputSize = (size_t)inWidth * inHeight * inChannels;
+		quantizedInput.resize(inputSize);
+		float invScale = 1 / layer.inputScale;
+		for (size_t i = 0; i < inputSize; i++)
+			quantizedInput[i] = quantize(input[i], invScale);
+		quantizedColumns.resize((size_t)numPixels * paddedFilterSize);
+		im2col(quantizedInput.data(), inWidth, inHeight, inChannels, layer.size, layer.stride, layer.padding, layer.width,
+			layer.height, paddedFilterSize, quantizedColumns.data());
+
+		parallel_for_(Range(0, numPixels), [&](const Range& range) {
+			int32_t sums[4];
+			for (int n = range.start; n < range.end; n++) {
+				const int16_t* col = quantizedColumns.data() + (size_t)n * paddedFilterSize;
+				int f = 0;
+				for (; f + 4 <= filters; f += 4) {
+					dot4(col, layer.quantizedWeights.data() + (size_t)f * paddedFilterSize, paddedFilterSize, sums);
+					for (int i = 0; i < 4; i++)
+						output[(size_t)(f + i) * numPixels + n] = sums[i] * layer.inputScale * layer.weightScales[f + i] +
+						layer.biases[f + i];
+				}
+				for (; f < filters; f++)
+					output[(size_t)f * numPixels + n] = dot(col, layer.quantizedWeights.data() + (size_t)f * paddedFilterSize,
+						paddedFilterSize) * layer.inputScale * layer.weightScales[f] + layer.biases[f];
+			}
+		});
+	}
+	activateArray(output, layer.output.size(), layer.activation);
+}
+
+int QuantizedNetwork::load(const string& cfgFileName, const string& weightFileName) {
+	DarknetModel model;
+	if (readDarknetModel(cfgFileName, weightFileName, model) < 0)
+		return -1;
+
+	const CfgSection& net = model.sections[0];
+	netWidth = net.getInt("width", 416);
+	netHeight = net.getInt("height", 416);
+	netChannels = net.getInt("channels", 3);
+	layers.clear();
+	int width = netWidth, height = netHeight, channels = netChannels;
+	size_t conv = 0;
+	for (size_t s = 1; s < model.sections.size(); s++) {
+		const CfgSection& section = model.sections[s];
+		int index = (int)layers.size();
+		Layer layer;
+		layer.type = section.type;
+		if (isConvolutional(layer.type)) {
+			const ConvWeights& weights = model.convs[conv++];
+			if (weights.groups != 1) {
+				cerr << "grouped convolutional layer " << index << " isn't supported" << endl;
+				return -1;
+			}
+			layer.size = weights.size;
+			layer.stride = section.getInt("stride", 1);
+			layer.padding = section.getInt("pad", 0) ? layer.size / 2 : section.getInt("padding", 0);
+			layer.activation = section.getString("activation", "logistic");
+			if (layer.activation.compare("linear") != 0 && layer.activation.compare("leaky") != 0 &&
+				layer.activation.compare("relu") != 0 && layer.activation.compare("logistic") != 0 &&
+				layer.activation.compare("mish") != 0 && layer.activation.compare("swish") != 0) {
+				cerr << "activation " << layer.activation << " of layer " << index << " isn't supported" << endl;
+				return -1;
+			}
+			layer.width = (width + 2 * layer.padding - layer.size) / layer.stride + 1;
+			layer.height = (height + 2 * layer.padding - layer.size) / layer.stride + 1;
+			layer.channels = weights.filters;
+			layer.biases = weights.biases;
+			layer.filterSize = channels * layer.size * layer.size;
+			layer.paddedFilterSize = (layer.filterSize + 7) / 8 * 8;
+
+			// symmetric int8 weights, scale per filter
+			size_t paddedFilterSize = layer.paddedFilterSize;
+			layer.weights.assign(paddedFilterSize * layer.channels, 0.f);
+			layer.quantizedWeights.assign(paddedFilterSize * layer.channels, 0);
+			layer.weightScales.resize(layer.channels);
+			for (int f = 0; f < layer.channels; f++) {
+				const float* src = weights.weights.data() + (size_t)f * layer.filterSize;
+				float maxAbs = 0;
+				for (int k = 0; k < layer.filterSize; k++)
+					maxAbs = max(maxAbs, fabs(src[k]));
+				float scale = maxAbs > 0 ? maxAbs / 127 : 1;
+				layer.weightScales[f] = scale;
+				for (int k = 0; k < layer.filterSize; k++) {
+					layer.weights[f * paddedFilterSize + k] = src[k];
+					layer.quantizedWeights[f * paddedFilterSize + k] = quantize(src[k], 1 / scale);
+				}
+			}
+		}
+		else if (layer.type.compare("shortcut") == 0) {
+			int from = section.getInt("from", -1);
+			from = from < 0 ? index + from : from;
+			if (from < 0 || from >= index || layers[from].width != width || layers[from].height != height ||
+				layers[from].channels != channels) {
+				cerr << "shortcut layer " << index << " refers wrong layer " << from << endl;
+				return -1;
+			}
+			layer.inputs.push_back(from);
+			layer.activation = section.getString("activation", "linear");
+			layer.width = width;
+			layer.height = height;
+			layer.channels = channels;
+		}
+		else if (layer.type.compare("route") == 0) {
+			if (section.getInt("groups", 1) != 1) {
+				cerr << "grouped route layer " << index << " isn't supported" << endl;
+				return -1;
+			}
+			layer.channels = 0;
+			for (float value : section.getList("layers")) {
+				int src = (int)value < 0 ? index + (int)value : (int)value;
+				// readDarknetModel has checked the range already
+				if (layer.channels > 0 && (layers[src].width != layer.width || layers[src].height != layer.height)) {
+					cerr << "route layer " << index << " concatenates layers of different sizes" << endl;
+					return -1;
+				}
+				layer.inputs.push_back(src);
+				layer.width = layers[src].width;
+				layer.height = layers[src].height;
+				layer.channels += layers[src].channels;
+			}
+		}
+		else if (layer.type.compare("upsample") == 0) {
+			layer.stride = section.getInt("stride", 2);
+			layer.scale = section.getFloat("scale", 1);
+			layer.width = width * layer.stride;
+			layer.height = height * layer.stride;
+			layer.channels = channels;
+		}
+		else if (layer.type.compare("maxpool") == 0) {
+			layer.size = section.getInt("size", 2);
+			layer.stride = section.getInt("stride", 2);
+			layer.padding = section.getInt("padding", layer.size - 1);
+			layer.width = (width + layer.padding - layer.size) / layer.stride + 1;
+			layer.height = (height + layer.padding - layer.size) / layer.stride + 1;
+			layer.channels = channels;
+		}
+		else if (layer.type.compare("yolo") == 0) {
+			layer.classes = section.getInt("classes", 20);
+			layer.anchors = section.getList("anchors");
+			for (float value : section.getList("mask"))
+				layer.mask.push_back((int)value);
+			if (layer.mask.empty())
+				for (int n = 0; n < section.getInt("num", 1); n++)
+					layer.mask.push_back(n);
+			layer.scaleXY = section.getFloat("scale_x_y", 1);
+			for (int n : layer.mask) {
+				if (n * 2 + 1 >= (int)layer.anchors.size()) {
+					cerr << "yolo layer " << index << " has less anchors than its mask" << endl;
+					return -1;
+				}
+			}
+			if (channels != (int)layer.mask.size() * (layer.classes + 5)) {
+				cerr << "input of yolo layer " << index << " doesn't match its classes" << endl;
+				return -1;
+			}
+			layer.width = width;
+			layer.height = height;
+			layer.channels = channels;
+		}
+		else {
+			cerr << "layer " << layer.type << " isn't supported by int8 backend" << endl;
+			return -1;
+		}
+		layer.output.resize((size_t)layer.width * layer.height * layer.channels);
+		width = layer.width;
+		height = layer.height;
+		channels = layer.channels;
+		layers.push_back(move(layer));
+	}
+	observedMaxSums.assign(layers.size(), 0);
+	numObserved = 0;
+	return 0;
+}
+
+bool QuantizedNetwork::isCalibrated() const {
+	for (const Layer& layer : layers)
+		if (isConvolutional(layer.type) && layer.inputScale <= 0)
+			return false;
+	return !layers.empty();
+}
+
+int QuantizedNetwork::readCalibration(const string& fileName) {
+	ifstream ifs(fileName);
+	if (!ifs.is_open()) {
+		cerr << "fail to load calibration file " << fileName << endl;
+		return -1;
+	}
+	int index;
+	float scale;
+	while (ifs >> index >> scale) {
+		if (index < 0 || index >= (int)layers.size() || !isConvolutional(layers[index].type) || scale <= 0) {
+			cerr << "calibration file " << fileName << " has wrong scale of layer " << index << endl;
+			return -1;
+		}
+		layers[index].inputScale = scale;
+	}
+	if (!isCalibrated()) {
+		cerr << "calibration file " << fileName << " doesn't have all convolutional layers" << endl;
+		return -1;
+	}
+	return 0;
+}
+
+int QuantizedNetwork::writeCalibration(const string& fileName) const {
+	ofstream ofs(fileName);
+	if (!ofs.is_open()) {
+		cerr << "fail to write calibration file " << fileName << endl;
+		return -1;
+	}
+	for (size_t i = 0; i < layers.size(); i++)
+		if (isConvolutional(layers[i].type))
+			ofs << i << " " << layers[i].inputScale << "\n";
+	return ofs ? 0 : -1;
+}
+
+void QuantizedNetwork::observe(const float* input) {
+	forward(input, false);
+	numObserved++;
+	for (size_t i = 0; i < layers.size(); i++) {
+		if (!isConvolutional(layers[i].type))
+			continue;
+		// input of convolutional layer is output of previous layer
+		const float* x = input;
+		size_t size = (size_t)netWidth * netHeight * netChannels;
+		if (i > 0) {
+			x = layers[i - 1].output.data();
+			size = layers[i - 1].output.size();
+		}
+		float maxAbs = 0;
+		for (size_t j = 0; j < size; j++)
+			maxAbs = max(maxAbs, fabs(x[j]));
+		observedMaxSums[i] += maxAbs;
+		float scale = (float)(observedMaxSums[i] / numObserved / 127);
+		layers[i].inputScale = scale > 0 ? scale : 1;
+	}
+}
+
+void QuantizedNetwork::forward(const float* input, bool quantized) {
+	int width = netWidth, height = netHeight, channels = netChannels;
+	for (size_t i = 0; i < layers.size(); i++) {
+		Layer& layer = layers[i];
+		const float* x = i == 0 ? input : layers[i - 1].output.data();
+		float* output = layer.output.data();
+		size_t planeSize = (size_t)layer.width * layer.height;
+
+		if (isConvolutional(layer.type))
+			forwardConvolutional(layer, x, width, height, channels, quantized);
+		else if (layer.type.compare("shortcut") == 0) {
+			const float* from = layers[layer.inputs[0]].output.data();
+			for (size_t j = 0; j < layer.output.size(); j++)
+				output[j] = x[j] + from[j];
+			activateArray(output, layer.output.size(), layer.activation);
+		}
+		else if (layer.type.compare("route") == 0) {
+			for (int src : layer.inputs) {
+				copy(layers[src].output.begin(), layers[src].output.end(), output);
+				output += layers[src].output.size();
+			}
+		}
+		else if (layer.type.compare("upsample") == 0) {
+			for (int c = 0; c < layer.channels; c++) {
+				for (int y = 0; y < layer.height; y++) {
+					const float* src = x + ((size_t)c * height + y / layer.stride) * width;
+					float* dst = output + ((size_t)c * layer.height + y) * layer.width;
+					for (int ox = 0; ox < layer.width; ox++)
+						dst[ox] = src[ox / layer.stride] * layer.scale;
+				}
+			}
+		}
+		else if (layer.type.compare("maxpool") == 0) {
+			int offset = -layer.padding / 2;
+			parallel_for_(Range(0, layer.channels), [&](const Range& range) {
+				for (int c = range.start; c < range.end; c++) {
+					const float* src = x + (size_t)c * width * height;
+					for (int oy = 0; oy < layer.height; oy++) {
+						for (int ox = 0; ox < layer.width; ox++) {
+							float value = -FLT_MAX;
+							for (int ky = 0; ky < layer.size; ky++) {
+								int y = oy * layer.stride + ky + offset;
+								if (y < 0 || y >= height)
+									continue;
+								for (int kx = 0; kx < layer.size; kx++) {
+									int px = ox * layer.stride + kx + offset;
+									if (px >= 0 && px < width)
+										value = max(value, src[(size_t)y * width + px]);
+								}
+							}
+							output[((size_t)c * layer.height + oy) * layer.width + ox] = value;
+						}
+					}
+				}
+			});
+		}
+		else if (layer.type.compare("yolo") == 0) {
+			// logistic on x, y, objectness and class probabilities as darknet does, width and height stay raw
+			copy(x, x + layer.output.size(), output);
+			for (size_t n = 0; n < layer.mask.size(); n++) {
+				float* entries = output + n * (layer.classes + 5) * planeSize;
+				activateArray(entries, 2 * planeSize, "logistic");
+				activateArray(entries + 4 * planeSize, (layer.classes + 1) * planeSize, "logistic");
+			}
+		}
+		width = layer.width;
+		height = layer.height;
+		channels = layer.channels;
+	}
+}
+
+vector<bbox_t> QuantizedNetwork::getBoxes(Size imageSize, float thresh, float nms) const {
+	vector<vector<Rect>> classBoxes;
+	vector<vector<float>> classProbs;
+	for (const Layer& layer : layers) {
+		if (layer.type.compare("yolo") != 0)
+			continue;
+		if ((int)classBoxes.size() < layer.classes) {
+			classBoxes.resize(layer.classes);
+			classProbs.resize(layer.classes);
+		}
+		size_t planeSize = (size_t)layer.width * layer.height;
+		for (size_t n = 0; n < layer.mask.size(); n++) {
+			const float* entries = layer.output.data() + n * (layer.classes + 5) * planeSize;
+			float anchorWidth = layer.anchors[layer.mask[n] * 2];
+			float anchorHeight = layer.anchors[layer.mask[n] * 2 + 1];
+			for (int row = 0; row < layer.height; row++) {
+				for (int col = 0; col < layer.width; col++) {
+					size_t cell = (size_t)row * layer.width + col;
+					float objectness = entries[4 * planeSize + cell];
+					if (objectness <= thresh)
+						continue;
+					// relative center and size as get_yolo_box of darknet
+					float bx = (col + entries[cell] * layer.scaleXY - (layer.scaleXY - 1) / 2) / layer.width;
+					float by = (row + entries[planeSize + cell] * layer.scaleXY - (layer.scaleXY - 1) / 2) / layer.height;
+					float bw = exp(entries[2 * planeSize + cell]) * anchorWidth / netWidth;
+					float bh = exp(entries[3 * planeSize + cell]) * anchorHeight / netHeight;
+					int w = (int)(bw * imageSize.width);
+					int h = (int)(bh * imageSize.height);
+					int x = (int)(bx * imageSize.width) - w / 2;
+					int y = (int)(by * imageSize.height) - h / 2;
+					for (int cls = 0; cls < layer.classes; cls++) {
+						float prob = objectness * entries[(5 + cls) * planeSize + cell];
+						if (prob <= thresh)
+							continue;
+						classBoxes[cls].push_back(Rect(x, y, w, h));
+						classProbs[cls].push_back(prob);
+					}
+				}
+			}
+		}
+	}
+
+	vector<bbox_t> bboxes;
+	for (size_t cls = 0; cls < classBoxes.size(); cls++) {
+		vector<int> indices;
+		dnn::NMSBoxes(classBoxes[cls], classProbs[cls], thresh, nms, indices);
+		for (int index : indices) {
+			Rect box = classBoxes[cls][index] & Rect(0, 0, imageSize.width, imageSize.height);
+			bbox_t bbox = {};
+			bbox.x = box.x;
+			bbox.y = box.y;
+			bbox.w = box.width;
+			bbox.h = box.height;
+			bbox.prob = classProbs[cls][index];
+			bbox.obj_id = (unsigned int)cls;
+			bboxes.push_back(bbox);
+		}
+	}
+	return bboxes;
+}
+
+QuantizedBackend::QuantizedBackend(const string& cfgFileName, const string& weightFileName) : success(false) {
+	if (network.load(cfgFileName, weightFileName) < 0 || network.readCalibration(getCalibrationFileName(weightFileName)) < 0) {
+		cerr << "fail to load int8 model of " << weightFileName << ", calibrate it first" << endl;
+		return;
+	}
+	netInput.reset(new NetInput(network.getNetWidth(), network.getNetHeight()));
+	success = true;
+}
+
+int QuantizedBackend::addInputSize(int width, int height) {
+	cerr << "int8 backend doesn't support input size " << width << "x" << height << endl;
+	return -1;
+}
+
+vector<bbox_t> QuantizedBackend::detect(const Mat& img, float thresh, bool /*useMean*/, int inputSize) {
+	if (img.data == NULL)
+		throw runtime_error("Image is empty");
+	if (inputSize != 0)
+		throw runtime_error("int8 backend has only one input size");
+
+	Mat blob;
+	if (netInput->set(img))
+		blob = netInput->getBlob();
+	else
+		blob = dnn::blobFromImage(img, 1 / 255.0, Size(netInput->width, netInput->height), Scalar(), true, false);
+	network.forward(blob.ptr<float>());
+	return network.getBoxes(img.size(), thresh, nms);
+}
+
+vector<bbox_t> QuantizedBackend::detect(const FrameBuffer& frame, float thresh, bool /*useMean*/, int inputSize) {
+	if (inputSize != 0)
+		throw runtime_error("int8 backend has only one input size");
+	if (!netInput->set(frame))
+		return vector<bbox_t>();
+	network.forward(netInput->getBlob().ptr<float>());
+	return network.getBoxes(Size(frame.width, frame.height), thresh, nms);
+}
+
+string getCalibrationFileName(const string& weightFileName) {
+	return weightFileName.substr(0, weightFileName.rfind('.')) + ".int8.table";
+}
+
+int calibrateQuantizedModel(const string& cfgFileName, const string& weightFileName, const string& imgDir) {
+	QuantizedNetwork network;
+	if (network.load(cfgFileName, weightFileName) < 0)
+		return -1;
+
+	NetInput netInput(network.getNetWidth(), network.getNetHeight());
+	int numImages = 0;
+	for (auto& file : filesystem::directory_iterator(imgDir)) {
+		string ext = file.path().extension().string();
+		if (ext.compare(".jpg") != 0)
+			continue;
+		Mat img = imread(file.path().string());
+		if (img.empty() || !netInput.set(img))
+			continue;
+		network.observe(netInput.getBlob().ptr<float>());
+		numImages++;
+	}
+	if (numImages == 0) {
+		cerr << "There is no calibration image in " << imgDir << endl;
+		return -1;
+	}
+
+	string calibrationFileName = getCalibrationFileName(weightFileName);
+	if (network.writeCalibration(calibrationFileName) < 0)
+		return -1;
+	cout << "calibration of " << numImages << " images is written to " << calibrationFileName << endl;
+	return 0;
+}
@@ -0,0 +1,109 @@
+#ifndef __QUANTIZED_HPP
+#define __QUANTIZED_HPP
+
+#include "backend.hpp"
+#include "fusedmodel.hpp"
+
+#include <cstdint>
+
+// darknet network run by its own CPU kernels. convolutions run on int8 weights(scale per filter) and int8 inputs
+// (scale per layer from calibration) with int32 accumulation, other layers run on float.
+// supports convolutional(groups=1), shortcut, route, upsample, maxpool and yolo layers
+class QuantizedNetwork {
+	class Layer {
+	public:
+		std::string type;
+		int width, height, channels; // output size
+		std::vector<float> output; // channels x height x width
+
+		// convolutional
+		int size = 0;
+		int stride = 1;
+		int padding = 0;
+		int filterSize = 0; // input channels x size x size
+		int paddedFilterSize = 0; // filterSize rounded up to multiple of 8
+		std::string activation;
+		std::vector<float> biases;
+		std::vector<float> weights; // filters x paddedFilterSize, for calibration
+		std::vector<int16_t> quantizedWeights; // filters x paddedFilterSize in int8 range, widened for 16 bit multiply-add
+		std::vector<float> weightScales;
+		float inputScale = 0; // 0 until calibrated
+
+		// route inputs, shortcut input
+		std::vector<int> inputs;
+		// upsample, maxpool
+		float scale = 1;
+
+		// yolo
+		std::vector<int> mask;
+		std::vector<float> anchors;
+		int classes = 0;
+		float scaleXY = 1;
+	};
+
+	std::vector<Layer> layers;
+	int netWidth;
+	int netHeight;
+	int netChannels;
+	// reused between layers and frames
+	std::vector<int16_t> quantizedInput;
+	std::vector<int16_t> quantizedColumns;
+	std::vector<float> columns;
+
+	void forwardConvolutional(Layer& layer, const float* input, int inWidth, int inHeight, int inChannels, bool quantized);
+
+public:
+	QuantizedNetwork() : netWidth(0), netHeight(0), netChannels(0) {}
+
+	int load(const std::string& cfgFileName, const std::string& weightFileName);
+	int getNetWidth() const { return netWidth; }
+	int getNetHeight() const { return netHeight; }
+	bool isCalibrated() const;
+
+	// input scale of each convolutional layer, one "layer scale" pair per line
+	int readCalibration(const std::string& fileName);
+	int writeCalibration(const std::string& fileName) const;
+	// run once for each calibration image in float, inputScale of convolutional layers becomes
+	// the mean of per image maximum input / 127 over the images observed so far
+	void observe(const float* input);
+
+	// input is planar float(0~1) of net size
+	void forward(const float* input, bool quantized = true);
+	// boxes of last forward in coordinates of image of imageSize
+	std::vector<bbox_t> getBoxes(cv::Size imageSize, float thresh, float nms) const;
+
+private:
+	std::vector<double> observedMaxSums;
+	int numObserved = 0;
+};
+
+// runs QuantizedNetwork, calibration file made by calibrateQuantizedModel shall exist. use_mean is ignored
+class QuantizedBackend : public InferenceBackend {
+	QuantizedNetwork network;
+	std::unique_ptr<NetInput> netInput;
+	bool success;
+
+public:
+	float nms = .4f;
+
+	QuantizedBackend(const std::string& cfgFileName, const std::string& weightFileName);
+
+	operator bool() const { return success; }
+
+	std::string getName() const override { return "int8"; }
+	int getNumInputSizes() const override { return 1; }
+	int getNetWidth(int /*inputSize*/ = 0) const override { return network.getNetWidth(); }
+	int getNetHeight(int /*inputSize*/ = 0) const override { return network.getNetHeight(); }
+	// layer sizes are fixed when network is loaded, so other input sizes aren't supported
+	int addInputSize(int width, int height) override;
+
+	std::vector<bbox_t> detect(const cv::Mat& img, float thresh = 0.2, bool use_mean = false, int inputSize = 0) override;
+	std::vector<bbox_t> detect(const FrameBuffer& frame, float thresh = 0.2, bool use_mean = false, int inputSize = 0) override;
+};
+
+// calibration file of model, written next to weights
+std::string getCalibrationFileName(const std::string& weightFileName);
+// find input scales of convolutional layers from jpg images of imgDir and write calibration file
+int calibrateQuantizedModel(const std::string& cfgFileName, const std::string& weightFileName, const std::string& imgDir);
+
+#endif
@@ -1,5 +1,18 @@
 #include "utility.hpp"
 
+#include <fstream>
+#include <iostream>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 using namespace std;
 
 cv::Scalar objIdToColor(int objId) {
@@ -16,4 +29,108 @@ std::string spaceToUnderBar(const std::string& str) {
 	for (size_t pos = ret.find(' '); pos != string::npos; pos = ret.find(' '))
 		ret[pos] = '_';
 	return ret;
-}
\ No newline at end of file
+}
+
+int readJpegSize(const std::string& fileName, cv::Size2i& size) {
+	ifstream ifs(fileName, ios::binary);
+	if (!ifs.is_open()) {
+		cerr << "fail to open " << fileName << endl;
+		return -1;
+	}
+	if (ifs.get() != 0xFF || ifs.get() != 0xD8) {
+		cerr << fileName << " is not jpg file" << endl;
+		return -1;
+	}
+
+	while (ifs) {
+		int marker = ifs.get();
+		if (marker != 0xFF)
+			break;
+		while (marker == 0xFF)
+			marker = ifs.get();
+		if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) // markers without length
+			continue;
+		if (marker == EOF || marker == 0xD9 || marker == 0xDA) // image data starts before frame header
+			break;
+
+		int length = ifs.get() << 8;
+		length |= ifs.get();
+		// SOF0 ~ SOF15 except DHT, JPG and DAC
+		if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+			ifs.get(); // sample precision
+			int height = ifs.get() << 8;
+			height |= ifs.get();
+			int width = ifs.get() << 8;
+			width |= ifs.get();
+			if (!ifs || width <= 0 || height <= 0)
+				break;
+			size = cv::Size2i(width, height);
+			return 0;
+		}
+		ifs.seekg(length - 2, ios::cur);
+	}
+	cerr << "fail to find frame header of " << fileName << endl;
+	return -1;
+}
+
+#ifdef _WIN32
+MappedFile::MappedFile(const std::string& fileName) : data(nullptr), size(0), fileHandle(INVALID_HANDLE_VALUE), mappingHandle(NULL) {
+	fileHandle = CreateFileA(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (fileHandle == INVALID_HANDLE_VALUE) {
+		cerr << "fail to open " << fileName << endl;
+		return;
+	}
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(fileHandle, &fileSize) || fileSize.QuadPart == 0) {
+		cerr << "fail to get size of " << fileName << endl;
+		return;
+	}
+	mappingHandle = CreateFileMappingA(fileHandle, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (mappingHandle == NULL) {
+		cerr << "fail to map " << fileName << endl;
+		return;
+	}
+	data = (const char*)MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0);
+	if (data == nullptr) {
+		cerr << "fail to map " << fileName << endl;
+		return;
+	}
+	size = (size_t)fileSize.QuadPart;
+}
+
+MappedFile::~MappedFile() {
+	if (data != nullptr)
+		UnmapViewOfFile(data);
+	if (mappingHandle != NULL)
+		CloseHandle(mappingHandle);
+	if (fileHandle != INVALID_HANDLE_VALUE)
+		CloseHandle(fileHandle);
+}
+#else
+MappedFile::MappedFile(const std::string& fileName) : data(nullptr), size(0), fd(-1) {
+	fd = open(fileName.c_str(), O_RDONLY);
+	if (fd < 0) {
+		cerr << "fail to open " << fileName << endl;
+		return;
+	}
+	struct stat st;
+	if (fstat(fd, &st) < 0 || st.st_size == 0) {
+		cerr << "fail to get size of " << fileName << endl;
+		return;
+	}
+	void* mapped = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (mapped == MAP_FAILED) {
+		cerr << "fail to map " << fileName << endl;
+		return;
+	}
+	data = (const char*)mapped;
+	size = (size_t)st.st_size;
+}
+
+MappedFile::~MappedFile() {
+	if (data != nullptr)
+		munmap((void*)data, size);
+	if (fd >= 0)
+		close(fd);
+}
+#endif
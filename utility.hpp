@@ -4,6 +4,25 @@
 #include <opencv2/core/types.hpp>
 #include <vector>
 #include <string>
+#include <queue>
+#include <mutex>
+#include <condition_variable>
+#include <memory_resource>
+#include <cstddef>
+
+constexpr size_t SCRATCH_ARENA_SIZE = 64 * 1024;
+
+// monotonic arena for short-lived containers of one call, starts from a buffer owned by the calling thread
+// and falls back to the heap when it runs out. only one arena may be alive on a thread at a time
+class ScratchArena : public std::pmr::monotonic_buffer_resource {
+	static std::byte* threadBuffer() {
+		thread_local std::byte buffer[SCRATCH_ARENA_SIZE];
+		return buffer;
+	}
+
+public:
+	ScratchArena() : std::pmr::monotonic_buffer_resource(threadBuffer(), SCRATCH_ARENA_SIZE) {}
+};
 
 template<class T>
 void clearPointerVec(std::vector<T*>& vec) {
@@ -12,7 +31,79 @@ void clearPointerVec(std::vector<T*>& vec) {
 	vec.clear();
 }
 
+// blocking queue with bounded capacity to connect stages running on different threads
+template<class T>
+class BoundedQueue {
+	std::queue<T> items;
+	size_t capacity;
+	bool closed;
+	std::mutex mtx;
+	std::condition_variable notFull;
+	std::condition_variable notEmpty;
+
+public:
+	BoundedQueue(size_t capacity) : capacity(capacity), closed(false) {}
+
+	// wait while queue is full, return false if queue is closed
+	bool push(T item) {
+		std::unique_lock<std::mutex> lock(mtx);
+		notFull.wait(lock, [this] { return closed || items.size() < capacity; });
+		if (closed)
+			return false;
+		items.push(std::move(item));
+		notEmpty.notify_one();
+		return true;
+	}
+	// wait while queue is empty, return false if queue is closed and no item is left
+	bool pop(T& item) {
+		std::unique_lock<std::mutex> lock(mtx);
+		notEmpty.wait(lock, [this] { return closed || !items.empty(); });
+		if (items.empty())
+			return false;
+		item = std::move(items.front());
+		items.pop();
+		notFull.notify_one();
+		return true;
+	}
+	// number of waiting items
+	size_t size() {
+		std::lock_guard<std::mutex> lock(mtx);
+		return items.size();
+	}
+	// no more items will be pushed, waiting pops return after remaining items are taken
+	void close() {
+		std::lock_guard<std::mutex> lock(mtx);
+		closed = true;
+		notFull.notify_all();
+		notEmpty.notify_all();
+	}
+};
+
+// read only memory mapping of a whole file, pages are shared with other mappings of the file
+class MappedFile {
+	const char* data;
+	size_t size;
+#ifdef _WIN32
+	void* fileHandle;
+	void* mappingHandle;
+#else
+	int fd;
+#endif
+
+public:
+	MappedFile(const std::string& fileName);
+	~MappedFile();
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	operator bool() const { return data != nullptr; }
+	const char* getData() const { return data; }
+	size_t getSize() const { return size; }
+};
+
 cv::Scalar objIdToColor(int objId);
 std::string spaceToUnderBar(const std::string& str);
+// read image size from SOF segment of jpg file without decoding it
+int readJpegSize(const std::string& fileName, cv::Size2i& size);
 
 #endif
\ No newline at end of file